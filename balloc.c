@@ -17,6 +17,9 @@
 #include <linux/sched.h>
 #include <linux/buffer_head.h>
 #include <linux/capability.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
 
 /*
  * balloc.c contains the blocks allocation and deallocation routines
@@ -36,6 +39,20 @@
 
 #define in_range(b, first, len)	((b) >= (first) && (b) <= (first) + (len) - 1)
 
+/*
+ * Block bitmaps may become uptodate through readahead rather than through
+ * read_block_bitmap(); this buffer state bit records that a bitmap has been
+ * run through ext21_valid_block_bitmap() once.
+ */
+enum ext21_bh_state_bits {
+	BH_BitmapChecked = BH_PrivateStart,
+};
+
+BUFFER_FNS(BitmapChecked, bitmap_checked)
+
+/* number of candidate group bitmaps read ahead during a group scan */
+#define EXT21_BITMAP_PREFETCH	8
+
 struct ext21_group_desc * ext21_get_group_desc(struct super_block * sb,
 					     unsigned int block_group,
 					     struct buffer_head ** bh)
@@ -139,10 +156,9 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 			    block_group, le32_to_cpu(desc->bg_block_bitmap));
 		return NULL;
 	}
-	if (likely(bh_uptodate_or_lock(bh)))
+	if (likely(buffer_bitmap_checked(bh)))
 		return bh;
-
-	if (bh_submit_read(bh) < 0) {
+	if (!bh_uptodate_or_lock(bh) && bh_submit_read(bh) < 0) {
 		brelse(bh);
 		ext21_error(sb, __func__,
 			    "Cannot read block bitmap - "
@@ -151,7 +167,13 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 		return NULL;
 	}
 
+	/*
+	 * The bitmap may have been read ahead, so check it here rather than
+	 * only right after our own read.  It is flagged as checked even if
+	 * invalid so that the error is reported once, as before.
+	 */
 	ext21_valid_block_bitmap(sb, desc, block_group, bh);
+	set_buffer_bitmap_checked(bh);
 	/*
 	 * file system mounted not to panic on error, continue with corrupt
 	 * bitmap
@@ -159,18 +181,121 @@ read_block_bitmap(struct super_block *sb, unsigned int block_group)
 	return bh;
 }
 
+/**
+ * ext21_prefetch_block_bitmaps()
+ * @sb:			superblock
+ * @group:		first group to look at
+ * @count:		number of groups to look at
+ * @min_free:		skip groups with no more than this many free blocks
+ *
+ * Start asynchronous reads of the block bitmaps of the groups an allocation
+ * scan is about to visit, so that a cold cache costs one round of seeks
+ * rather than one synchronous read per group.  Groups the scan would skip
+ * anyway are left alone.
+ */
+static void ext21_prefetch_block_bitmaps(struct super_block *sb,
+					 unsigned int group, unsigned int count,
+					 unsigned int min_free)
+{
+	unsigned long ngroups = EXT21_SB(sb)->s_groups_count;
+	struct ext21_group_desc *desc;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	while (count--) {
+		if (group >= ngroups)
+			group = 0;
+		if (ext21_group_free_blocks(sb, group) > min_free) {
+			desc = ext21_get_group_desc(sb, group, NULL);
+			if (desc)
+				sb_breadahead(sb,
+					le32_to_cpu(desc->bg_block_bitmap));
+		}
+		group++;
+	}
+	blk_finish_plug(&plug);
+}
+
+/**
+ * ext21_warm_block_bitmaps() -- read every useful block bitmap in advance
+ * @work:		s_bitmap_warm_work of the filesystem
+ *
+ * Queued at mount time with the prefetch_bitmaps option, so that the first
+ * allocations after mount do not have to read bitmaps synchronously.  Stops
+ * early when the option is cleared, which put_super does before waiting
+ * for it.
+ */
+void ext21_warm_block_bitmaps(struct work_struct *work)
+{
+	struct ext21_sb_info *sbi = container_of(work, struct ext21_sb_info,
+						 s_bitmap_warm_work);
+	struct super_block *sb = sbi->s_sb;
+	unsigned long group;
+
+	for (group = 0; group < sbi->s_groups_count;
+	     group += EXT21_BITMAP_PREFETCH) {
+		if (!test_opt(sb, PREFETCH_BITMAPS))
+			break;
+		ext21_prefetch_block_bitmaps(sb, group,
+			min_t(unsigned long, EXT21_BITMAP_PREFETCH,
+			      sbi->s_groups_count - group), 0);
+		cond_resched();
+	}
+}
+
+/*
+ * Only the in-memory counter is touched here: up to EXT21_DESC_PER_BLOCK
+ * groups share one descriptor buffer, and dirtying it on every allocation
+ * makes writers in unrelated groups contend on it.
+ * ext21_fold_group_counters() writes the counts back at sync time.
+ */
 static void group_adjust_blocks(struct super_block *sb, int group_no,
-	struct ext21_group_desc *desc, struct buffer_head *bh, int count)
+				int count)
 {
 	if (count) {
 		struct ext21_sb_info *sbi = EXT21_SB(sb);
-		unsigned free_blocks;
 
 		spin_lock(sb_bgl_lock(sbi, group_no));
-		free_blocks = le16_to_cpu(desc->bg_free_blocks_count);
-		desc->bg_free_blocks_count = cpu_to_le16(free_blocks + count);
+		sbi->s_group_free_blocks[group_no] += count;
 		spin_unlock(sb_bgl_lock(sbi, group_no));
-		mark_buffer_dirty(bh);
+	}
+}
+
+/**
+ * ext21_fold_group_counters() -- write free block counts to the descriptors
+ * @sb:			super block
+ *
+ * Copy the in-memory free block count of every group into its group
+ * descriptor and dirty the descriptor blocks that changed, so that what
+ * reaches the disk at sync, freeze and unmount is consistent with the
+ * bitmaps.  The descriptor blocks are reached directly rather than through
+ * ext21_get_group_desc(), since this runs from ext21_error() too.
+ */
+void ext21_fold_group_counters(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	struct ext21_group_desc *desc;
+	struct buffer_head *bh;
+	unsigned long group;
+	int dirty;
+
+	if (!sbi->s_group_free_blocks)
+		return;
+	for (group = 0; group < sbi->s_groups_count; group++) {
+		bh = sbi->s_group_desc[group >> EXT21_DESC_PER_BLOCK_BITS(sb)];
+		desc = (struct ext21_group_desc *) bh->b_data +
+			(group & (EXT21_DESC_PER_BLOCK(sb) - 1));
+		dirty = 0;
+		spin_lock(sb_bgl_lock(sbi, group));
+		if (le16_to_cpu(desc->bg_free_blocks_count) !=
+		    sbi->s_group_free_blocks[group]) {
+			desc->bg_free_blocks_count =
+				cpu_to_le16(sbi->s_group_free_blocks[group]);
+			dirty = 1;
+		}
+		spin_unlock(sb_bgl_lock(sbi, group));
+		if (dirty)
+			mark_buffer_dirty(bh);
 	}
 }
 
@@ -225,6 +350,12 @@ restart:
 			       rsv);
 			bad = 1;
 		}
+		if (prev && rsv->rsv_gap !=
+				rsv->rsv_start - prev->rsv_end - 1) {
+			printk("Bad reservation %p (stale gap %lu)\n",
+			       rsv, rsv->rsv_gap);
+			bad = 1;
+		}
 		if (bad) {
 			if (!verbose) {
 				printk("Restarting reservation walk in verbose mode\n");
@@ -319,6 +450,102 @@ search_reserve_window(struct rb_root *root, ext21_fsblk_t goal)
 	return rsv;
 }
 
+/*
+ * The reservation tree is augmented with the size of the free gap in
+ * front of every window (rsv_gap) and the largest such gap below each
+ * node (rsv_subtree_gap), so that a gap of a given size can be found
+ * without walking every window in the filesystem.
+ */
+static inline ext21_fsblk_t
+rsv_compute_subtree_gap(struct ext21_reserve_window_node *rsv)
+{
+	ext21_fsblk_t max = rsv->rsv_gap, sub;
+
+	if (rsv->rsv_node.rb_left) {
+		sub = rb_entry(rsv->rsv_node.rb_left,
+			struct ext21_reserve_window_node, rsv_node)->rsv_subtree_gap;
+		if (sub > max)
+			max = sub;
+	}
+	if (rsv->rsv_node.rb_right) {
+		sub = rb_entry(rsv->rsv_node.rb_right,
+			struct ext21_reserve_window_node, rsv_node)->rsv_subtree_gap;
+		if (sub > max)
+			max = sub;
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, rsv_gap_callbacks,
+		     struct ext21_reserve_window_node, rsv_node,
+		     ext21_fsblk_t, rsv_subtree_gap, rsv_compute_subtree_gap)
+
+/*
+ * rsv_update_gap() -- recompute the gap in front of a window
+ * @rsv:		window whose start or predecessor has changed
+ *
+ * Must be called with rsv_lock held, with @rsv linked into the tree.
+ */
+static void rsv_update_gap(struct ext21_reserve_window_node *rsv)
+{
+	struct rb_node *prev = rb_prev(&rsv->rsv_node);
+
+	if (prev)
+		rsv->rsv_gap = rsv->rsv_start - rb_entry(prev,
+			struct ext21_reserve_window_node, rsv_node)->rsv_end - 1;
+	else
+		rsv->rsv_gap = 0;
+	rsv_gap_callbacks_propagate(&rsv->rsv_node, NULL);
+}
+
+/*
+ * rsv_window_moved() -- fix up the augmented tree after a window changed
+ * @rsv:		window whose start and/or end block moved in place
+ *
+ * Both the gap in front of @rsv and the gap in front of its successor
+ * depend on the window boundaries. Must be called with rsv_lock held.
+ */
+static void rsv_window_moved(struct ext21_reserve_window_node *rsv)
+{
+	struct rb_node *next = rb_next(&rsv->rsv_node);
+
+	rsv_update_gap(rsv);
+	if (next)
+		rsv_update_gap(rb_entry(next, struct ext21_reserve_window_node,
+					rsv_node));
+}
+
+/*
+ * __rsv_find_gap() -- find the first window preceded by a large enough gap
+ * @n:			subtree to search
+ * @after:		only consider windows starting after this block
+ * @size:		minimum gap size
+ *
+ * Returns the leftmost window in the subtree which starts after @after and
+ * has at least @size free blocks in front of it, or NULL.  Subtrees whose
+ * largest gap is too small are skipped, so this is O(log n) in the number
+ * of windows.
+ */
+static struct ext21_reserve_window_node *
+__rsv_find_gap(struct rb_node *n, ext21_fsblk_t after, ext21_fsblk_t size)
+{
+	struct ext21_reserve_window_node *rsv, *found;
+
+	if (!n)
+		return NULL;
+	rsv = rb_entry(n, struct ext21_reserve_window_node, rsv_node);
+	if (rsv->rsv_subtree_gap < size)
+		return NULL;
+	if (rsv->rsv_start > after) {
+		found = __rsv_find_gap(n->rb_left, after, size);
+		if (found)
+			return found;
+		if (rsv->rsv_gap >= size)
+			return rsv;
+	}
+	return __rsv_find_gap(n->rb_right, after, size);
+}
+
 /*
  * ext21_rsv_window_add() -- Insert a window to the block reservation rb tree.
  * @sb:			super block
@@ -353,7 +580,11 @@ void ext21_rsv_window_add(struct super_block *sb,
 	}
 
 	rb_link_node(node, parent, p);
-	rb_insert_color(node, root);
+	rsv->rsv_gap = 0;
+	rsv->rsv_subtree_gap = 0;
+	/* the new leaf is linked, so rb_prev()/rb_next() already see it */
+	rsv_window_moved(rsv);
+	rb_insert_augmented(node, root, &rsv_gap_callbacks);
 }
 
 /**
@@ -368,10 +599,17 @@ void ext21_rsv_window_add(struct super_block *sb,
 static void rsv_window_remove(struct super_block *sb,
 			      struct ext21_reserve_window_node *rsv)
 {
+	struct rb_node *next = rb_next(&rsv->rsv_node);
+
 	rsv->rsv_start = EXT21_RESERVE_WINDOW_NOT_ALLOCATED;
 	rsv->rsv_end = EXT21_RESERVE_WINDOW_NOT_ALLOCATED;
 	rsv->rsv_alloc_hit = 0;
-	rb_erase(&rsv->rsv_node, &EXT21_SB(sb)->s_rsv_window_root);
+	rb_erase_augmented(&rsv->rsv_node, &EXT21_SB(sb)->s_rsv_window_root,
+			   &rsv_gap_callbacks);
+	/* the successor now starts after our predecessor */
+	if (next)
+		rsv_update_gap(rb_entry(next, struct ext21_reserve_window_node,
+					rsv_node));
 }
 
 /*
@@ -412,41 +650,186 @@ void ext21_init_block_alloc_info(struct inode *inode)
 	struct ext21_inode_info *ei = EXT21_I(inode);
 	struct ext21_block_alloc_info *block_i;
 	struct super_block *sb = inode->i_sb;
+	int i;
 
 	block_i = kmalloc(sizeof(*block_i), GFP_NOFS);
 	if (block_i) {
-		struct ext21_reserve_window_node *rsv = &block_i->rsv_window_node;
+		for (i = 0; i < EXT21_ALLOC_STREAMS; i++) {
+			struct ext21_alloc_stream *stream = &block_i->streams[i];
+			struct ext21_reserve_window_node *rsv =
+						&stream->rsv_window_node;
+
+			rsv->rsv_start = EXT21_RESERVE_WINDOW_NOT_ALLOCATED;
+			rsv->rsv_end = EXT21_RESERVE_WINDOW_NOT_ALLOCATED;
+
+		 	/*
+			 * if filesystem is mounted with NORESERVATION, the goal
+			 * reservation window size is set to zero to indicate
+			 * block reservation is off
+			 */
+			if (!test_opt(sb, RESERVATION))
+				rsv->rsv_goal_size = 0;
+			else if (S_ISDIR(inode->i_mode))
+				rsv->rsv_goal_size = EXT21_SB(sb)->s_dir_prealloc;
+			else
+				rsv->rsv_goal_size = EXT21_DEFAULT_RESERVE_BLOCKS;
+			rsv->rsv_alloc_hit = 0;
+			rsv->rsv_max_size = EXT21_MAX_RESERVE_BLOCKS;
+			stream->last_alloc_logical_block = 0;
+			stream->last_alloc_physical_block = 0;
+			stream->last_used = 0;
+		}
+		block_i->cur_stream = &block_i->streams[0];
+		block_i->alloc_seq = 0;
+	}
+	ei->i_block_alloc_info = block_i;
+}
 
-		rsv->rsv_start = EXT21_RESERVE_WINDOW_NOT_ALLOCATED;
-		rsv->rsv_end = EXT21_RESERVE_WINDOW_NOT_ALLOCATED;
+/**
+ * ext21_select_alloc_stream()
+ * @inode:		file inode
+ * @block:		logical block about to be allocated
+ *
+ * Pick the allocation stream (and so the reservation window) that serves
+ * an allocation at @block, and make it the current one.  A stream whose
+ * last allocation lies just before @block continues; otherwise an unused
+ * stream, or the least recently used one, is handed over to the new
+ * region.  This keeps writers of different parts of one file from
+ * stealing each other's window and interleaving their blocks on disk.
+ *
+ * Needs truncate_mutex protection prior to calling this function.
+ */
+struct ext21_alloc_stream *ext21_select_alloc_stream(struct inode *inode,
+						     unsigned long block)
+{
+	struct ext21_block_alloc_info *block_i = EXT21_I(inode)->i_block_alloc_info;
+	struct ext21_alloc_stream *stream, *best = NULL, *lru = NULL;
+	unsigned long dist, best_dist = ~0UL, reach;
+	int i;
 
-	 	/*
-		 * if filesystem is mounted with NORESERVATION, the goal
-		 * reservation window size is set to zero to indicate
-		 * block reservation is off
-		 */
-		if (!test_opt(sb, RESERVATION))
-			rsv->rsv_goal_size = 0;
-		else
-			rsv->rsv_goal_size = EXT21_DEFAULT_RESERVE_BLOCKS;
-		rsv->rsv_alloc_hit = 0;
-		block_i->last_alloc_logical_block = 0;
-		block_i->last_alloc_physical_block = 0;
+	if (!block_i)
+		return NULL;
+
+	for (i = 0; i < EXT21_ALLOC_STREAMS; i++) {
+		stream = &block_i->streams[i];
+		if (!lru || stream->last_used < lru->last_used)
+			lru = stream;
+		if (!stream->last_alloc_physical_block ||
+		    block <= stream->last_alloc_logical_block)
+			continue;
+		/* a stream may skip ahead by up to one window */
+		reach = stream->rsv_window_node.rsv_goal_size;
+		if (reach < EXT21_DEFAULT_RESERVE_BLOCKS)
+			reach = EXT21_DEFAULT_RESERVE_BLOCKS;
+		dist = block - stream->last_alloc_logical_block;
+		if (dist <= reach && dist < best_dist) {
+			best = stream;
+			best_dist = dist;
+		}
 	}
-	ei->i_block_alloc_info = block_i;
+	if (!best) {
+		/* a new region: recycle the stream idle for the longest */
+		best = lru;
+		best->last_alloc_logical_block = 0;
+		best->last_alloc_physical_block = 0;
+	}
+	best->last_used = ++block_i->alloc_seq;
+	block_i->cur_stream = best;
+	return best;
+}
+
+static void ext21_retain_inode(struct inode *inode);
+
+/*
+ * Quota batching: allocations made through a reservation window charge
+ * quota for a whole window at once and keep the part not allocated yet as
+ * the inode's quota credit, which the following allocations draw from
+ * without touching the dquots.  i_blocks only ever counts allocated
+ * blocks.  The credit is settled when the window is discarded, before the
+ * inode changes owner or drops its dquots, and whenever quota is synced,
+ * reported or turned off.  All of it needs truncate_mutex protection.
+ */
+
+/*
+ * Charge quota for @num blocks about to be allocated, drawing on the quota
+ * credit, or charging @batch blocks to refill it if @batch is larger.
+ */
+static int ext21_charge_blocks(struct inode *inode, unsigned long num,
+			       unsigned long batch)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+
+	if (ei->i_quota_credit >= num) {
+		ei->i_quota_credit -= num;
+		inode_add_bytes(inode, (loff_t)num << inode->i_blkbits);
+		mark_inode_dirty_sync(inode);
+		return 0;
+	}
+	if (batch > num && sb_any_quota_active(inode->i_sb) &&
+	    !IS_NOQUOTA(inode) && !dquot_alloc_block(inode, batch)) {
+		ei->i_quota_credit += batch - num;
+		inode_sub_bytes(inode, (loff_t)(batch - num) << inode->i_blkbits);
+		/* sync and quota reporting find the credit on that list */
+		ext21_retain_inode(inode);
+		return 0;
+	}
+	/* a full batch might not fit under the limit while @num does */
+	return dquot_alloc_block(inode, num);
+}
+
+/*
+ * Undo ext21_charge_blocks() for @num blocks that were not allocated
+ * after all; with batching they go back to the credit.
+ */
+static void ext21_uncharge_blocks(struct inode *inode, unsigned long num,
+				  unsigned long batch)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+
+	if (batch && sb_any_quota_active(inode->i_sb) && !IS_NOQUOTA(inode)) {
+		ei->i_quota_credit += num;
+		inode_sub_bytes(inode, (loff_t)num << inode->i_blkbits);
+		ext21_retain_inode(inode);
+	} else {
+		dquot_free_block_nodirty(inode, num);
+	}
+	mark_inode_dirty(inode);
+}
+
+/**
+ * ext21_settle_quota()
+ * @inode:		inode
+ *
+ * Give the quota charged ahead of allocation back to the dquots.
+ */
+void ext21_settle_quota(struct inode *inode)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	unsigned long credit = ei->i_quota_credit;
+
+	if (!credit)
+		return;
+	ei->i_quota_credit = 0;
+	/* dquot_free_block() takes the blocks off i_blocks as well */
+	inode_add_bytes(inode, (loff_t)credit << inode->i_blkbits);
+	dquot_free_block_nodirty(inode, credit);
 }
 
 /**
  * ext21_discard_reservation()
  * @inode:		inode
  *
- * Discard(free) block reservation window on last file close, or truncate
- * or at last iput().
+ * Discard(free) the block reservation windows of all allocation streams
+ * on last file close, or truncate or at last iput().
  *
- * It is being called in three cases:
- * 	ext21_release_file(): last writer closes the file
+ * It is being called in these cases:
+ * 	ext21_release_file(): last writer closes the file, unless the
+ * 		reservation is kept across close
  * 	ext21_clear_inode(): last iput(), when nobody links to this file.
  * 	ext21_truncate(): when the block indirect map is about to change.
+ * 	the retained-reservation shrinker, under memory pressure.
+ *
+ * Quota charged ahead for the windows is settled as well.
  */
 void ext21_discard_reservation(struct inode *inode)
 {
@@ -454,35 +837,40 @@ void ext21_discard_reservation(struct inode *inode)
 	struct ext21_block_alloc_info *block_i = ei->i_block_alloc_info;
 	struct ext21_reserve_window_node *rsv;
 	spinlock_t *rsv_lock = &EXT21_SB(inode->i_sb)->s_rsv_window_lock;
+	int i;
 
+	ext21_settle_quota(inode);
 	if (!block_i)
 		return;
 
-	rsv = &block_i->rsv_window_node;
-	if (!rsv_is_empty(&rsv->rsv_window)) {
-		spin_lock(rsv_lock);
-		if (!rsv_is_empty(&rsv->rsv_window))
-			rsv_window_remove(inode->i_sb, rsv);
-		spin_unlock(rsv_lock);
+	for (i = 0; i < EXT21_ALLOC_STREAMS; i++) {
+		rsv = &block_i->streams[i].rsv_window_node;
+		if (!rsv_is_empty(&rsv->rsv_window)) {
+			spin_lock(rsv_lock);
+			if (!rsv_is_empty(&rsv->rsv_window))
+				rsv_window_remove(inode->i_sb, rsv);
+			spin_unlock(rsv_lock);
+		}
 	}
 }
 
 /**
- * ext21_free_blocks() -- Free given blocks and update quota and i_blocks
- * @inode:		inode
+ * __ext21_free_blocks() -- Free given blocks in the bitmaps and counters
+ * @sb:			super block
  * @block:		start physical block to free
  * @count:		number of blocks to free
+ *
+ * Returns the number of blocks actually freed; quota and i_blocks are
+ * left to the caller.
  */
-void ext21_free_blocks (struct inode * inode, unsigned long block,
-		       unsigned long count)
+static unsigned long __ext21_free_blocks(struct super_block *sb,
+				unsigned long block, unsigned long count)
 {
 	struct buffer_head *bitmap_bh = NULL;
-	struct buffer_head * bh2;
 	unsigned long block_group;
 	unsigned long bit;
 	unsigned long i;
 	unsigned long overflow;
-	struct super_block * sb = inode->i_sb;
 	struct ext21_sb_info * sbi = EXT21_SB(sb);
 	struct ext21_group_desc * desc;
 	struct ext21_super_block * es = sbi->s_es;
@@ -518,7 +906,7 @@ do_more:
 	if (!bitmap_bh)
 		goto error_return;
 
-	desc = ext21_get_group_desc (sb, block_group, &bh2);
+	desc = ext21_get_group_desc (sb, block_group, NULL);
 	if (!desc)
 		goto error_return;
 
@@ -549,7 +937,7 @@ do_more:
 	if (sb->s_flags & MS_SYNCHRONOUS)
 		sync_dirty_buffer(bitmap_bh);
 
-	group_adjust_blocks(sb, block_group, desc, bh2, group_freed);
+	group_adjust_blocks(sb, block_group, group_freed);
 	freed += group_freed;
 
 	if (overflow) {
@@ -559,13 +947,450 @@ do_more:
 	}
 error_return:
 	brelse(bitmap_bh);
-	if (freed) {
+	if (freed)
 		percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+	return freed;
+}
+
+/**
+ * ext21_free_blocks() -- Free given blocks and update quota and i_blocks
+ * @inode:		inode
+ * @block:		start physical block to free
+ * @count:		number of blocks to free
+ */
+void ext21_free_blocks (struct inode * inode, unsigned long block,
+		       unsigned long count)
+{
+	unsigned long freed = __ext21_free_blocks(inode->i_sb, block, count);
+
+	if (freed) {
 		dquot_free_block_nodirty(inode, freed);
 		mark_inode_dirty(inode);
 	}
 }
 
+/*
+ * Queue the inode on the per-filesystem retained list, if it is not there
+ * already.
+ */
+static void ext21_retain_inode(struct inode *inode)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+
+	spin_lock(&sbi->s_retained_lock);
+	if (list_empty(&ei->i_retained)) {
+		list_add_tail(&ei->i_retained, &sbi->s_retained_list);
+		sbi->s_retained_count++;
+	}
+	spin_unlock(&sbi->s_retained_lock);
+}
+
+/**
+ * ext21_retain_reservation()
+ * @inode:		inode
+ *
+ * Called instead of ext21_discard_reservation() when the last writer
+ * closes a file that keeps its reservation across close (mount option
+ * keeprsv or EXT21_ALLOC_KEEPRSV).  The windows stay in the tree so the next
+ * writer continues where the last one stopped; the inode is queued on the
+ * per-filesystem retained list, from which the shrinker releases windows
+ * under memory pressure.  Truncate and eviction release them as usual.
+ *
+ * Needs truncate_mutex protection prior to calling this function.
+ */
+void ext21_retain_reservation(struct inode *inode)
+{
+	if (EXT21_I(inode)->i_block_alloc_info)
+		ext21_retain_inode(inode);
+}
+
+/**
+ * ext21_forget_retained()
+ * @inode:		inode
+ *
+ * Take the inode off the retained list; called before its allocation
+ * state is torn down at eviction.
+ */
+void ext21_forget_retained(struct inode *inode)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+
+	spin_lock(&sbi->s_retained_lock);
+	if (!list_empty(&ei->i_retained)) {
+		list_del_init(&ei->i_retained);
+		sbi->s_retained_count--;
+	}
+	spin_unlock(&sbi->s_retained_lock);
+}
+
+/**
+ * ext21_recycle_blocks()
+ * @inode:		inode being truncated to zero
+ * @block:		start physical block
+ * @count:		number of blocks
+ *
+ * With the reuse_truncated mount option, truncate hands the blocks of a
+ * file it empties to this function instead of ext21_free_blocks().  They
+ * stay allocated in the bitmap and go on the inode's recycle list, sorted
+ * by block number; quota and i_blocks are released right away.  A rewrite
+ * of the file takes them back in order (ext21_new_recycled_blocks()), so its
+ * layout stays the same and the bitmaps are not touched.  Whatever is not
+ * reused is released after EXT21_RECYCLE_GRACE, on last close, under
+ * memory pressure or when the filesystem runs out of space.
+ *
+ * Returns 0 if the blocks were kept, or an error if the caller should free
+ * them.  Needs truncate_mutex protection prior to calling this function.
+ */
+int ext21_recycle_blocks(struct inode *inode, ext21_fsblk_t block,
+			 unsigned long count)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+	struct ext21_super_block *es = sbi->s_es;
+	struct list_head *pos = &ei->i_recycle;
+	struct ext21_recycle_extent *ext, *prev = NULL, *next = NULL;
+
+	/* leave bogus ranges to ext21_free_blocks() to complain about */
+	if (block < le32_to_cpu(es->s_first_data_block) ||
+	    block + count < block ||
+	    block + count > le32_to_cpu(es->s_blocks_count))
+		return -EINVAL;
+
+	/* truncate frees mostly in ascending order: search from the end */
+	list_for_each_entry_reverse(ext, &ei->i_recycle, list) {
+		if (ext->start < block) {
+			pos = &ext->list;
+			prev = ext;
+			break;
+		}
+	}
+	if (pos->next != &ei->i_recycle)
+		next = list_entry(pos->next, struct ext21_recycle_extent, list);
+
+	if (prev && prev->start + prev->len == block) {
+		prev->len += count;
+		if (next && block + count == next->start) {
+			prev->len += next->len;
+			list_del(&next->list);
+			kfree(next);
+			ei->i_recycle_extents--;
+		}
+	} else if (next && block + count == next->start) {
+		next->start = block;
+		next->len += count;
+	} else {
+		if (ei->i_recycle_extents >= EXT21_RECYCLE_MAX_EXTENTS)
+			return -ENOSPC;
+		ext = kmalloc(sizeof(*ext), GFP_NOFS);
+		if (!ext)
+			return -ENOMEM;
+		ext->start = block;
+		ext->len = count;
+		list_add(&ext->list, pos);
+		ei->i_recycle_extents++;
+	}
+
+	dquot_free_block_nodirty(inode, count);
+	mark_inode_dirty(inode);
+	ei->i_recycle_expires = jiffies + EXT21_RECYCLE_GRACE;
+	ext21_retain_inode(inode);
+	queue_delayed_work(system_long_wq, &sbi->s_recycle_work,
+			   EXT21_RECYCLE_GRACE);
+	return 0;
+}
+
+/**
+ * ext21_new_recycled_blocks()
+ * @inode:		file inode
+ * @goal:		given target block(filesystem wide)
+ * @count:		target number of blocks to allocate
+ *
+ * Hand out blocks from the head of the recycle list, if that is where
+ * @goal points (ext21_find_goal() makes sure it does), so a rewrite gets
+ * the blocks back in their old order.  Charges quota like
+ * ext21_new_blocks().  Returns the first block and trims *count, or 0 if
+ * the caller should allocate from the bitmaps instead.
+ *
+ * Needs truncate_mutex protection prior to calling this function.
+ */
+ext21_fsblk_t ext21_new_recycled_blocks(struct inode *inode,
+				ext21_fsblk_t goal, unsigned long *count)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_recycle_extent *ext;
+	unsigned long num;
+
+	ext = list_first_entry_or_null(&ei->i_recycle,
+				       struct ext21_recycle_extent, list);
+	if (!ext || ext->start != goal)
+		return 0;
+
+	num = min(*count, ext->len);
+	if (ext21_charge_blocks(inode, num, 0))
+		return 0;
+
+	ext->start += num;
+	ext->len -= num;
+	if (!ext->len) {
+		list_del(&ext->list);
+		kfree(ext);
+		ei->i_recycle_extents--;
+	}
+	*count = num;
+	return goal;
+}
+
+/**
+ * ext21_release_recycled()
+ * @inode:		inode
+ *
+ * Give the blocks on the inode's recycle list back to the filesystem.
+ * Needs truncate_mutex protection prior to calling this function, unless
+ * the inode is being evicted.
+ */
+void ext21_release_recycled(struct inode *inode)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_recycle_extent *ext, *tmp;
+
+	list_for_each_entry_safe(ext, tmp, &ei->i_recycle, list) {
+		__ext21_free_blocks(inode->i_sb, ext->start, ext->len);
+		list_del(&ext->list);
+		kfree(ext);
+	}
+	ei->i_recycle_extents = 0;
+}
+
+/* take truncate_mutex of a retained inode; false if busy and not @wait */
+static bool ext21_lock_retained(struct ext21_inode_info *ei, bool wait)
+{
+	if (!wait)
+		return mutex_trylock(&ei->truncate_mutex);
+	mutex_lock(&ei->truncate_mutex);
+	return true;
+}
+
+/*
+ * Walk up to @nr inodes off the retained list.  With @all, everything they
+ * hold on to is released; otherwise only recycled blocks whose grace
+ * period is over.  Inodes that still hold something are requeued,
+ * including those busy allocating, unless @wait has us wait for them.
+ * Returns the number of inodes that released something.
+ */
+static unsigned long ext21_scan_retained(struct ext21_sb_info *sbi,
+					 unsigned long nr, bool all, bool wait)
+{
+	struct ext21_inode_info *ei;
+	struct inode *inode;
+	unsigned long freed = 0;
+	bool keep;
+
+	while (nr--) {
+		spin_lock(&sbi->s_retained_lock);
+		if (list_empty(&sbi->s_retained_list)) {
+			spin_unlock(&sbi->s_retained_lock);
+			break;
+		}
+		ei = list_first_entry(&sbi->s_retained_list,
+				      struct ext21_inode_info, i_retained);
+		list_del_init(&ei->i_retained);
+		sbi->s_retained_count--;
+		/* an inode being evicted releases its windows by itself */
+		inode = igrab(&ei->vfs_inode);
+		spin_unlock(&sbi->s_retained_lock);
+		if (!inode)
+			continue;
+
+		/*
+		 * somebody is allocating, so the windows are in use again;
+		 * whatever the inode holds stays on the list, for the next
+		 * scan, the expiry work and the quota settling to find
+		 */
+		keep = true;
+		if (ext21_lock_retained(ei, wait)) {
+			if (all) {
+				ext21_discard_reservation(inode);
+				ext21_release_recycled(inode);
+				freed++;
+				keep = false;
+			} else {
+				if (!list_empty(&ei->i_recycle) &&
+				    time_after_eq(jiffies, ei->i_recycle_expires)) {
+					ext21_release_recycled(inode);
+					freed++;
+				}
+				keep = !list_empty(&ei->i_recycle) ||
+					ei->i_quota_credit ||
+					(ei->i_block_alloc_info &&
+					 atomic_read(&inode->i_writecount) <= 0);
+			}
+			mutex_unlock(&ei->truncate_mutex);
+		}
+		if (keep)
+			ext21_retain_inode(inode);
+		iput(inode);
+	}
+	return freed;
+}
+
+static unsigned long ext21_retained_count(struct shrinker *shrink,
+					  struct shrink_control *sc)
+{
+	struct ext21_sb_info *sbi = container_of(shrink, struct ext21_sb_info,
+						 s_retained_shrinker);
+
+	return sbi->s_retained_count;
+}
+
+static unsigned long ext21_retained_scan(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	struct ext21_sb_info *sbi = container_of(shrink, struct ext21_sb_info,
+						 s_retained_shrinker);
+
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	return ext21_scan_retained(sbi, sc->nr_to_scan, true, false);
+}
+
+/*
+ * Release recycled blocks whose grace period is over; runs after the grace
+ * period of the latest recycling and again while any are left.
+ */
+static void ext21_recycle_expire(struct work_struct *work)
+{
+	struct ext21_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext21_sb_info, s_recycle_work);
+	struct ext21_inode_info *ei;
+	bool again = false;
+
+	ext21_scan_retained(sbi, sbi->s_retained_count, false, false);
+
+	spin_lock(&sbi->s_retained_lock);
+	list_for_each_entry(ei, &sbi->s_retained_list, i_retained) {
+		if (!list_empty(&ei->i_recycle)) {
+			again = true;
+			break;
+		}
+	}
+	spin_unlock(&sbi->s_retained_lock);
+	if (again)
+		queue_delayed_work(system_long_wq, &sbi->s_recycle_work,
+				   EXT21_RECYCLE_GRACE);
+}
+
+/**
+ * ext21_release_retained()
+ * @sb:			super block
+ *
+ * Release everything the retained inodes hold on to, waiting for those
+ * busy allocating: while freezing, so that no allocated but unowned blocks
+ * reach the frozen image, and before remounting read-only.  Not from
+ * ->freeze_fs, as the last iput() of a deleted inode needs
+ * sb_start_intwrite().
+ */
+void ext21_release_retained(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	ext21_scan_retained(sbi, sbi->s_retained_count, true, true);
+}
+
+static void ext21_release_work(struct work_struct *work)
+{
+	struct ext21_sb_info *sbi = container_of(work, struct ext21_sb_info,
+						 s_release_work);
+
+	ext21_scan_retained(sbi, sbi->s_retained_count, true, false);
+}
+
+/**
+ * ext21_release_retained_async()
+ * @sb:			super block
+ *
+ * ext21_release_retained() for an allocation that ran out of space: it
+ * holds truncate_mutex and a page lock, and the final iput() of another
+ * inode could delete it right there, so the worker does it instead.
+ */
+void ext21_release_retained_async(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	if (sbi->s_retained_count)
+		queue_work(system_long_wq, &sbi->s_release_work);
+}
+
+/**
+ * ext21_settle_quota_all()
+ * @sb:			super block
+ *
+ * Settle the quota credit of every inode, so that quota usage is exact
+ * before it is synced, reported or turned off.  Inodes with credit are
+ * on the retained list; unlike the shrinker this waits for their locks.
+ */
+void ext21_settle_quota_all(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	struct ext21_inode_info *ei;
+	struct inode *inode;
+	LIST_HEAD(pending);
+	bool keep;
+
+	spin_lock(&sbi->s_retained_lock);
+	list_splice_init(&sbi->s_retained_list, &pending);
+	spin_unlock(&sbi->s_retained_lock);
+
+	for (;;) {
+		/* ext21_forget_retained() may take entries off meanwhile */
+		spin_lock(&sbi->s_retained_lock);
+		if (list_empty(&pending)) {
+			spin_unlock(&sbi->s_retained_lock);
+			break;
+		}
+		ei = list_first_entry(&pending, struct ext21_inode_info,
+				      i_retained);
+		list_del_init(&ei->i_retained);
+		sbi->s_retained_count--;
+		/* an inode being evicted settles by itself */
+		inode = igrab(&ei->vfs_inode);
+		spin_unlock(&sbi->s_retained_lock);
+		if (!inode)
+			continue;
+
+		mutex_lock(&ei->truncate_mutex);
+		ext21_settle_quota(inode);
+		keep = ei->i_block_alloc_info || !list_empty(&ei->i_recycle);
+		mutex_unlock(&ei->truncate_mutex);
+		if (keep)
+			ext21_retain_inode(inode);
+		iput(inode);
+	}
+}
+
+/**
+ * ext21_register_retained_shrinker()
+ * @sb:			super block
+ *
+ * Set up the retained list of @sb and register its shrinker.
+ */
+int ext21_register_retained_shrinker(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	spin_lock_init(&sbi->s_retained_lock);
+	INIT_LIST_HEAD(&sbi->s_retained_list);
+	sbi->s_retained_count = 0;
+	INIT_DELAYED_WORK(&sbi->s_recycle_work, ext21_recycle_expire);
+	INIT_WORK(&sbi->s_release_work, ext21_release_work);
+	sbi->s_retained_shrinker.count_objects = ext21_retained_count;
+	sbi->s_retained_shrinker.scan_objects = ext21_retained_scan;
+	sbi->s_retained_shrinker.seeks = DEFAULT_SEEKS;
+	return register_shrinker(&sbi->s_retained_shrinker);
+}
+
 /**
  * bitmap_search_next_usable_block()
  * @start:		the starting block (group relative) of the search
@@ -587,6 +1412,106 @@ bitmap_search_next_usable_block(ext21_grpblk_t start, struct buffer_head *bh,
 	return next;
 }
 
+/**
+ * find_next_free_run()
+ * @start:		the starting block (group relative) of the search
+ * @bh:			bufferhead contains the block group bitmap
+ * @maxblocks:		the ending block (group relative) of the search
+ * @want:		minimum length of the run
+ *
+ * Find the first run of at least @want free blocks that starts at or after
+ * @start and ends before @maxblocks.  Both ends of every run are found a
+ * word at a time, so the cost depends on the number of runs skipped rather
+ * than on the number of bits.  Returns -1 if there is no such run.
+ */
+static ext21_grpblk_t
+find_next_free_run(ext21_grpblk_t start, struct buffer_head *bh,
+			ext21_grpblk_t maxblocks, unsigned long want)
+{
+	ext21_grpblk_t here = start, end;
+
+	while (here < maxblocks) {
+		here = ext21_find_next_zero_bit(bh->b_data, maxblocks, here);
+		if (here >= maxblocks)
+			break;
+		end = ext21_find_next_bit(bh->b_data, maxblocks, here);
+		if (end - here >= want)
+			return here;
+		here = end;
+	}
+	return -1;
+}
+
+/*
+ * Block bitmaps are little-endian bit arrays; these convert between a word
+ * as loaded from the bitmap and the same word with bit n holding block n.
+ */
+static inline unsigned long ext21_bitmap_word(unsigned long word)
+{
+#if BITS_PER_LONG == 64
+	return le64_to_cpu((__force __le64)word);
+#else
+	return le32_to_cpu((__force __le32)word);
+#endif
+}
+
+static inline unsigned long ext21_bitmap_mask(unsigned int bit,
+					      unsigned int nbits)
+{
+	unsigned long mask = nbits == BITS_PER_LONG ? ~0UL :
+					((1UL << nbits) - 1) << bit;
+
+	return ext21_bitmap_word(mask);
+}
+
+/**
+ * claim_free_run()
+ * @bh:			bufferhead contains the block group bitmap
+ * @start:		first block (group relative) to claim
+ * @len:		number of blocks wanted
+ *
+ * Atomically mark up to @len blocks from @start in use, a whole bitmap word
+ * at a time.  Like claiming them one by one with ext21_set_bit_atomic(), it
+ * stops in front of the first block somebody else owns, so the blocks
+ * claimed are always contiguous.  Returns the number of blocks claimed,
+ * which is 0 if @start itself was taken.
+ */
+static unsigned long
+claim_free_run(struct buffer_head *bh, ext21_grpblk_t start, unsigned long len)
+{
+	unsigned long *addr = (unsigned long *)bh->b_data + start / BITS_PER_LONG;
+	unsigned int bit = start % BITS_PER_LONG;
+	unsigned long claimed = 0;
+
+	while (claimed < len) {
+		unsigned int nbits = min_t(unsigned long, BITS_PER_LONG - bit,
+					   len - claimed);
+		unsigned long mask = ext21_bitmap_mask(bit, nbits);
+		unsigned long old, busy;
+
+		for (;;) {
+			old = READ_ONCE(*addr);
+			busy = old & mask;
+			if (busy) {
+				/* only the free blocks in front of it */
+				nbits = __ffs(ext21_bitmap_word(busy)) - bit;
+				if (!nbits)
+					return claimed;
+				mask = ext21_bitmap_mask(bit, nbits);
+			}
+			if (cmpxchg(addr, old, old | mask) == old)
+				break;
+		}
+		claimed += nbits;
+		/* stopped short of the word end: the run is over */
+		if (bit + nbits < BITS_PER_LONG)
+			break;
+		addr++;
+		bit = 0;
+	}
+	return claimed;
+}
+
 /**
  * find_next_usable_block()
  * @start:		the starting block (group relative) to find next
@@ -596,14 +1521,13 @@ bitmap_search_next_usable_block(ext21_grpblk_t start, struct buffer_head *bh,
  *
  * Find an allocatable block in a bitmap.  We perform the "most
  * appropriate allocation" algorithm of looking for a free block near
- * the initial goal; then for a free byte somewhere in the bitmap;
- * then for any free bit in the bitmap.
+ * the initial goal; then for a run of eight free blocks somewhere in
+ * the bitmap; then for any free bit in the bitmap.
  */
 static ext21_grpblk_t
 find_next_usable_block(int start, struct buffer_head *bh, int maxblocks)
 {
 	ext21_grpblk_t here, next;
-	char *p, *r;
 
 	if (start > 0) {
 		/*
@@ -627,17 +1551,47 @@ find_next_usable_block(int start, struct buffer_head *bh, int maxblocks)
 	if (here < 0)
 		here = 0;
 
-	p = ((char *)bh->b_data) + (here >> 3);
-	r = memscan(p, 0, ((maxblocks + 7) >> 3) - (here >> 3));
-	next = (r - ((char *)bh->b_data)) << 3;
-
-	if (next < maxblocks && next >= here)
+	next = find_next_free_run(here, bh, maxblocks, 8);
+	if (next >= 0)
 		return next;
 
 	here = bitmap_search_next_usable_block(here, bh, maxblocks);
 	return here;
 }
 
+/**
+ * find_next_aligned_block()
+ * @sb:			superblock
+ * @group:		block group the bitmap belongs to
+ * @bh:			bufferhead contains the block group bitmap
+ * @start:		the starting block (group relative) of the search
+ * @maxblocks:		the ending block (group relative) for the search
+ * @align:		required alignment, in filesystem blocks
+ *
+ * Find a free block in a bitmap whose filesystem block number is a multiple
+ * of @align, so that a large allocation starts on a RAID stripe boundary.
+ * Returns -1 if there is none.
+ */
+static ext21_grpblk_t
+find_next_aligned_block(struct super_block *sb, int group,
+			struct buffer_head *bh, ext21_grpblk_t start,
+			ext21_grpblk_t maxblocks, unsigned long align)
+{
+	ext21_fsblk_t group_first_block = ext21_group_first_block_no(sb, group);
+	ext21_grpblk_t here = start;
+
+	while (here < maxblocks) {
+		here = roundup(group_first_block + here, align) -
+							group_first_block;
+		if (here >= maxblocks)
+			break;
+		if (!ext21_test_bit(here, bh->b_data))
+			return here;
+		here = ext21_find_next_zero_bit(bh->b_data, maxblocks, here);
+	}
+	return -1;
+}
+
 /**
  * ext21_try_to_allocate()
  * @sb:			superblock
@@ -655,7 +1609,8 @@ find_next_usable_block(int start, struct buffer_head *bh, int maxblocks)
  * 	if there is a reservation window, only try to allocate block(s)
  * 	from the file's own reservation window;
  * 	Otherwise, the allocation range starts from the give goal block,
- * 	ends at the block group's last block.
+ * 	ends at the block group's last block.  Without a goal, a request
+ * 	spanning a RAID stripe (or chunk) starts on a stripe boundary.
  *
  * If we failed to allocate the desired block then we may end up crossing to a
  * new bitmap.
@@ -669,6 +1624,7 @@ ext21_try_to_allocate(struct super_block *sb, int group,
 	ext21_fsblk_t group_first_block;
        	ext21_grpblk_t start, end;
 	unsigned long num = 0;
+	unsigned long align = my_rsv ? 1 : ext21_alloc_align(sb, *count);
 
 	/* we do allocation within the reservation window if we have a window */
 	if (my_rsv) {
@@ -697,6 +1653,16 @@ ext21_try_to_allocate(struct super_block *sb, int group,
 	BUG_ON(start > EXT21_BLOCKS_PER_GROUP(sb));
 
 repeat:
+	if (grp_goal < 0 && align > 1) {
+		grp_goal = find_next_aligned_block(sb, group, bitmap_bh,
+						   start, end, align);
+		/* fall back to any free block if no aligned one is left */
+		if (grp_goal < 0)
+			align = 1;
+	}
+	/* without a goal, prefer a free run that fits the whole request */
+	if (grp_goal < 0 && *count > 1)
+		grp_goal = find_next_free_run(start, bitmap_bh, end, *count);
 	if (grp_goal < 0) {
 		grp_goal = find_next_usable_block(start, bitmap_bh, end);
 		if (grp_goal < 0)
@@ -713,28 +1679,24 @@ repeat:
 	}
 	start = grp_goal;
 
-	if (ext21_set_bit_atomic(sb_bgl_lock(EXT21_SB(sb), group), grp_goal,
-			       				bitmap_bh->b_data)) {
+	num = claim_free_run(bitmap_bh, grp_goal,
+			     min_t(unsigned long, *count, end - grp_goal));
+	if (!num) {
 		/*
 		 * The block was allocated by another thread, or it was
-		 * allocated and then freed by another thread
+		 * allocated and then freed by another thread.  Move on to
+		 * the next free block, skipping a densely used area a word
+		 * at a time.
 		 */
-		start++;
-		grp_goal++;
+		grp_goal = ext21_find_next_zero_bit(bitmap_bh->b_data, end,
+						    start + 1);
+		start = grp_goal;
 		if (start >= end)
 			goto fail_access;
 		goto repeat;
 	}
-	num++;
-	grp_goal++;
-	while (num < *count && grp_goal < end
-		&& !ext21_set_bit_atomic(sb_bgl_lock(EXT21_SB(sb), group),
-					grp_goal, bitmap_bh->b_data)) {
-		num++;
-		grp_goal++;
-	}
 	*count = num;
-	return grp_goal - num;
+	return grp_goal;
 fail_access:
 	*count = num;
 	return -1;
@@ -770,7 +1732,8 @@ fail_access:
  * 	basically we search from the given range, rather than the whole
  * 	reservation double linked list, (start_block, last_block)
  * 	to find a free region that is of my size and has not
- * 	been reserved.
+ * 	been reserved.  Past the first gap the search descends the
+ * 	gap-augmented tree instead of visiting every window.
  *
  */
 static int find_next_reservable_window(
@@ -784,47 +1747,74 @@ static int find_next_reservable_window(
 	struct ext21_reserve_window_node *rsv, *prev;
 	ext21_fsblk_t cur;
 	int size = my_rsv->rsv_goal_size;
+	unsigned long align = ext21_alloc_align(sb, size);
 
-	/* TODO: make the start of the reservation window byte-aligned */
-	/* cur = *start_block & ~7;*/
+	/*
+	 * On a striped device windows start on a stripe (or chunk) boundary
+	 * and cover whole stripes, so that the writeback of a full window
+	 * does not turn into read-modify-write cycles.
+	 */
+	size = roundup(size, align);
 	cur = start_block;
 	rsv = search_head;
 	if (!rsv)
 		return -1;
 
-	while (1) {
-		if (cur <= rsv->rsv_end)
-			cur = rsv->rsv_end + 1;
-
-		/* TODO?
-		 * in the case we could not find a reservable space
-		 * that is what is expected, during the re-search, we could
-		 * remember what's the largest reservable space we could have
-		 * and return that one.
-		 *
-		 * For now it will fail if we could not find the reservable
-		 * space with expected-size (or more)...
-		 */
-		if (cur > last_block)
-			return -1;		/* fail */
-
-		prev = rsv;
-		next = rb_next(&rsv->rsv_node);
-		rsv = rb_entry(next,struct ext21_reserve_window_node,rsv_node);
-
-		/*
-		 * Reached the last reservation, we can just append to the
-		 * previous one.
-		 */
-		if (!next)
-			break;
-
-		if (cur + size <= rsv->rsv_start) {
+	/*
+	 * The caller may hand us a head well before start_block (on retry
+	 * it is our own old window): shift to the window that contains or
+	 * precedes start_block first.
+	 */
+	next = rb_next(&rsv->rsv_node);
+	if (next && rb_entry(next, struct ext21_reserve_window_node,
+			     rsv_node)->rsv_start <= start_block)
+		rsv = search_reserve_window(&EXT21_SB(sb)->s_rsv_window_root,
+					    start_block);
+
+	if (cur <= rsv->rsv_end)
+		cur = rsv->rsv_end + 1;
+	cur = roundup(cur, align);
+
+	/* TODO?
+	 * in the case we could not find a reservable space
+	 * that is what is expected, during the re-search, we could
+	 * remember what's the largest reservable space we could have
+	 * and return that one.
+	 *
+	 * For now it will fail if we could not find the reservable
+	 * space with expected-size (or more)...
+	 */
+	if (cur > last_block)
+		return -1;		/* fail */
+
+	prev = rsv;
+	next = rb_next(&rsv->rsv_node);
+	if (next) {
+		rsv = rb_entry(next, struct ext21_reserve_window_node, rsv_node);
+		if (cur + size > rsv->rsv_start) {
 			/*
-			 * Found a reserveable space big enough.  We could
-			 * have a reservation across the group boundary here
-		 	 */
-			break;
+			 * The space right after the search head is too small
+			 * (start_block may sit in the middle of it).  Every
+			 * later gap is whole, so let the augmented tree find
+			 * the first one of at least our size, or append after
+			 * the last window if there is none.  Ask for enough
+			 * slack to round the start up to the alignment.
+			 */
+			rsv = __rsv_find_gap(EXT21_SB(sb)->s_rsv_window_root.rb_node,
+					     rsv->rsv_start, size + align - 1);
+			if (rsv) {
+				cur = rsv->rsv_start - rsv->rsv_gap;
+				next = rb_prev(&rsv->rsv_node);
+			} else {
+				next = rb_last(&EXT21_SB(sb)->s_rsv_window_root);
+			}
+			prev = rb_entry(next, struct ext21_reserve_window_node,
+					rsv_node);
+			if (!rsv)
+				cur = prev->rsv_end + 1;
+			cur = roundup(cur, align);
+			if (cur > last_block)
+				return -1;	/* fail */
 		}
 	}
 	/*
@@ -854,6 +1844,8 @@ static int find_next_reservable_window(
 
 	if (prev != my_rsv)
 		ext21_rsv_window_add(sb, my_rsv);
+	else
+		rsv_window_moved(my_rsv);
 
 	return 0;
 }
@@ -943,11 +1935,23 @@ static int alloc_new_reservation(struct ext21_reserve_window_node *my_rsv,
 			 * if the previously allocation hit ratio is
 			 * greater than 1/2, then we double the size of
 			 * the reservation window the next time,
-			 * otherwise we keep the same size window
+			 * up to the limit the file size allows
 			 */
 			size = size * 2;
-			if (size > EXT21_MAX_RESERVE_BLOCKS)
-				size = EXT21_MAX_RESERVE_BLOCKS;
+			if (size > my_rsv->rsv_max_size)
+				size = my_rsv->rsv_max_size;
+			my_rsv->rsv_goal_size= size;
+		} else if ((my_rsv->rsv_alloc_hit <
+		     (my_rsv->rsv_end - my_rsv->rsv_start + 1) / 8) &&
+			   (size > EXT21_DEFAULT_RESERVE_BLOCKS)) {
+			/*
+			 * we are leaving a window we barely used: the
+			 * writer is seeking around, so halve the window
+			 * instead of booking large unused ranges
+			 */
+			size = size / 2;
+			if (size < EXT21_DEFAULT_RESERVE_BLOCKS)
+				size = EXT21_DEFAULT_RESERVE_BLOCKS;
 			my_rsv->rsv_goal_size= size;
 		}
 	}
@@ -1058,6 +2062,7 @@ static void try_to_extend_reservation(struct ext21_reserve_window_node *my_rsv,
 			my_rsv->rsv_end += size;
 		else
 			my_rsv->rsv_end = next_rsv->rsv_start - 1;
+		rsv_update_gap(next_rsv);
 	}
 	spin_unlock(rsv_lock);
 }
@@ -1193,6 +2198,36 @@ static int ext21_has_free_blocks(struct ext21_sb_info *sbi)
 	return 1;
 }
 
+/**
+ * ext21_rsv_max_size()
+ * @inode:		file inode
+ *
+ * Return how far the reservation window of @inode may grow.  Small files
+ * keep the classic EXT21_MAX_RESERVE_BLOCKS limit; a large file may
+ * reserve up to an eighth of its current size ahead of the writer, within
+ * EXT21_MAX_LARGE_RESERVE_BLOCKS and a quarter of a block group.
+ * Directories grow a block at a time and stop at
+ * EXT21_MAX_DIR_RESERVE_BLOCKS, or at the dir_prealloc= size if larger.
+ */
+static unsigned int ext21_rsv_max_size(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long max;
+
+	if (S_ISDIR(inode->i_mode))
+		return max_t(unsigned long, EXT21_MAX_DIR_RESERVE_BLOCKS,
+			     EXT21_SB(sb)->s_dir_prealloc);
+
+	max = (i_size_read(inode) >> EXT21_BLOCK_SIZE_BITS(sb)) >> 3;
+	if (max > EXT21_MAX_LARGE_RESERVE_BLOCKS)
+		max = EXT21_MAX_LARGE_RESERVE_BLOCKS;
+	if (max > EXT21_BLOCKS_PER_GROUP(sb) / 4)
+		max = EXT21_BLOCKS_PER_GROUP(sb) / 4;
+	if (max < EXT21_MAX_RESERVE_BLOCKS)
+		max = EXT21_MAX_RESERVE_BLOCKS;
+	return max;
+}
+
 /*
  * ext21_new_blocks() -- core block(s) allocation function
  * @inode:		file inode
@@ -1211,7 +2246,6 @@ ext21_fsblk_t ext21_new_blocks(struct inode *inode, ext21_fsblk_t goal,
 		    unsigned long *count, int *errp)
 {
 	struct buffer_head *bitmap_bh = NULL;
-	struct buffer_head *gdp_bh;
 	int group_no;
 	int goal_group;
 	ext21_grpblk_t grp_target_blk;	/* blockgroup relative goal block */
@@ -1229,36 +2263,43 @@ ext21_fsblk_t ext21_new_blocks(struct inode *inode, ext21_fsblk_t goal,
 	unsigned short windowsz = 0;
 	unsigned long ngroups;
 	unsigned long num = *count;
+	unsigned long batch = 0;
 	int ret;
 
 	*errp = -ENOSPC;
 	sb = inode->i_sb;
-
-	/*
-	 * Check quota for allocation of this block.
-	 */
-	ret = dquot_alloc_block(inode, num);
-	if (ret) {
-		*errp = ret;
-		return 0;
-	}
-
 	sbi = EXT21_SB(sb);
 	es = EXT21_SB(sb)->s_es;
 	ext21_debug("goal=%lu.\n", goal);
 	/*
 	 * Allocate a block from reservation only when
 	 * filesystem is mounted with reservation(default,-o reservation), and
-	 * it's a regular file, and
+	 * it's a regular file, or a directory with dir_prealloc= set, and
 	 * the desired window size is greater than 0 (One could use ioctl
 	 * command EXT21_IOC_SETRSVSZ to set the window size to 0 to turn off
-	 * reservation on that particular file)
+	 * reservation on that particular file), and
+	 * the file has grown past the smallfile= packing threshold, and
+	 * its blocks are not placed by offset (EXT21_ALLOC_PROPORTIONAL)
 	 */
 	block_i = EXT21_I(inode)->i_block_alloc_info;
 	if (block_i) {
-		windowsz = block_i->rsv_window_node.rsv_goal_size;
-		if (windowsz > 0)
-			my_rsv = &block_i->rsv_window_node;
+		windowsz = block_i->cur_stream->rsv_window_node.rsv_goal_size;
+		if (windowsz > 0 && !ext21_is_small_file(inode) &&
+		    !(EXT21_I(inode)->i_alloc_flags &
+		      EXT21_ALLOC_PROPORTIONAL)) {
+			my_rsv = &block_i->cur_stream->rsv_window_node;
+			my_rsv->rsv_max_size = ext21_rsv_max_size(inode);
+			batch = windowsz;
+		}
+	}
+
+	/*
+	 * Check quota for allocation of this block.
+	 */
+	ret = ext21_charge_blocks(inode, num, batch);
+	if (ret) {
+		*errp = ret;
+		return 0;
 	}
 
 	if (!ext21_has_free_blocks(sbi)) {
@@ -1276,11 +2317,11 @@ ext21_fsblk_t ext21_new_blocks(struct inode *inode, ext21_fsblk_t goal,
 			EXT21_BLOCKS_PER_GROUP(sb);
 	goal_group = group_no;
 retry_alloc:
-	gdp = ext21_get_group_desc(sb, group_no, &gdp_bh);
+	gdp = ext21_get_group_desc(sb, group_no, NULL);
 	if (!gdp)
 		goto io_error;
 
-	free_blocks = le16_to_cpu(gdp->bg_free_blocks_count);
+	free_blocks = ext21_group_free_blocks(sb, group_no);
 	/*
 	 * if there is not enough free blocks to make a new resevation
 	 * turn off reservation for this allocation
@@ -1314,11 +2355,20 @@ retry_alloc:
 		group_no++;
 		if (group_no >= ngroups)
 			group_no = 0;
-		gdp = ext21_get_group_desc(sb, group_no, &gdp_bh);
+		/*
+		 * read the next few candidates' bitmaps while this one
+		 * is searched
+		 */
+		if (!(bgi % EXT21_BITMAP_PREFETCH))
+			ext21_prefetch_block_bitmaps(sb, group_no,
+				min_t(unsigned long, EXT21_BITMAP_PREFETCH,
+				      ngroups - bgi),
+				my_rsv ? windowsz / 2 : 0);
+		gdp = ext21_get_group_desc(sb, group_no, NULL);
 		if (!gdp)
 			goto io_error;
 
-		free_blocks = le16_to_cpu(gdp->bg_free_blocks_count);
+		free_blocks = ext21_group_free_blocks(sb, group_no);
 		/*
 		 * skip this group (and avoid loading bitmap) if there
 		 * are no free blocks
@@ -1365,7 +2415,7 @@ retry_alloc:
 allocated:
 
 	ext21_debug("using block group %d(%d)\n",
-			group_no, gdp->bg_free_blocks_count);
+			group_no, ext21_group_free_blocks(sb, group_no));
 
 	ret_block = grp_alloc_blk + ext21_group_first_block_no(sb, group_no);
 
@@ -1397,7 +2447,7 @@ allocated:
 		goto out;
 	}
 
-	group_adjust_blocks(sb, group_no, gdp, gdp_bh, -num);
+	group_adjust_blocks(sb, group_no, -num);
 	percpu_counter_sub(&sbi->s_freeblocks_counter, num);
 
 	mark_buffer_dirty(bitmap_bh);
@@ -1407,8 +2457,7 @@ allocated:
 	*errp = 0;
 	brelse(bitmap_bh);
 	if (num < *count) {
-		dquot_free_block_nodirty(inode, *count-num);
-		mark_inode_dirty(inode);
+		ext21_uncharge_blocks(inode, *count-num, batch);
 		*count = num;
 	}
 	return ret_block;
@@ -1419,10 +2468,8 @@ out:
 	/*
 	 * Undo the block allocation
 	 */
-	if (!performed_allocation) {
-		dquot_free_block_nodirty(inode, *count);
-		mark_inode_dirty(inode);
-	}
+	if (!performed_allocation)
+		ext21_uncharge_blocks(inode, *count, batch);
 	brelse(bitmap_bh);
 	return 0;
 }
@@ -1445,10 +2492,10 @@ unsigned long ext21_count_free(struct buffer_head *map, unsigned int numchars)
 
 unsigned long ext21_count_free_blocks (struct super_block * sb)
 {
-	struct ext21_group_desc * desc;
 	unsigned long desc_count = 0;
 	int i;
 #ifdef EXT21FS_DEBUG
+	struct ext21_group_desc * desc;
 	unsigned long bitmap_count, x;
 	struct ext21_super_block *es;
 
@@ -1461,14 +2508,14 @@ unsigned long ext21_count_free_blocks (struct super_block * sb)
 		desc = ext21_get_group_desc (sb, i, NULL);
 		if (!desc)
 			continue;
-		desc_count += le16_to_cpu(desc->bg_free_blocks_count);
+		desc_count += ext21_group_free_blocks(sb, i);
 		bitmap_bh = read_block_bitmap(sb, i);
 		if (!bitmap_bh)
 			continue;
 		
 		x = ext21_count_free(bitmap_bh, sb->s_blocksize);
 		printk ("group %d: stored = %d, counted = %lu\n",
-			i, le16_to_cpu(desc->bg_free_blocks_count), x);
+			i, ext21_group_free_blocks(sb, i), x);
 		bitmap_count += x;
 		brelse(bitmap_bh);
 	}
@@ -1477,12 +2524,8 @@ unsigned long ext21_count_free_blocks (struct super_block * sb)
 		desc_count, bitmap_count);
 	return bitmap_count;
 #else
-        for (i = 0; i < EXT21_SB(sb)->s_groups_count; i++) {
-                desc = ext21_get_group_desc (sb, i, NULL);
-                if (!desc)
-                        continue;
-                desc_count += le16_to_cpu(desc->bg_free_blocks_count);
-	}
+        for (i = 0; i < EXT21_SB(sb)->s_groups_count; i++)
+                desc_count += ext21_group_free_blocks(sb, i);
 	return desc_count;
 #endif
 }
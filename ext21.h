@@ -37,16 +37,29 @@ struct ext21_reserve_window_node {
 	struct rb_node	 	rsv_node;
 	__u32			rsv_goal_size;
 	__u32			rsv_alloc_hit;
+	/* upper bound for rsv_goal_size when the window grows by itself */
+	__u32			rsv_max_size;
 	struct ext21_reserve_window	rsv_window;
+	/*
+	 * Free space between the previous window in the tree and this one,
+	 * and the largest such gap in the rb subtree rooted at this node.
+	 * Both are protected by s_rsv_window_lock.
+	 */
+	ext21_fsblk_t		rsv_gap;
+	ext21_fsblk_t		rsv_subtree_gap;
 };
 
-struct ext21_block_alloc_info {
+/*
+ * An allocation stream follows one sequential writer of a file: it has its
+ * own reservation window and remembers where that writer left off.
+ */
+struct ext21_alloc_stream {
 	/* information about reservation window */
 	struct ext21_reserve_window_node	rsv_window_node;
 	/*
 	 * was i_next_alloc_block in ext21_inode_info
 	 * is the logical (file-relative) number of the
-	 * most-recently-allocated block in this file.
+	 * most-recently-allocated block in this stream.
 	 * We use this for detecting linearly ascending allocation requests.
 	 */
 	__u32			last_alloc_logical_block;
@@ -54,10 +67,23 @@ struct ext21_block_alloc_info {
 	 * Was i_next_alloc_goal in ext21_inode_info
 	 * is the *physical* companion to i_next_alloc_block.
 	 * it the the physical block number of the block which was most-recentl
-	 * allocated to this file.  This give us the goal (target) for the next
+	 * allocated to this stream.  This give us the goal (target) for the next
 	 * allocation when we detect linearly ascending requests.
 	 */
 	ext21_fsblk_t		last_alloc_physical_block;
+	/* value of alloc_seq when the stream was last used */
+	unsigned long		last_used;
+};
+
+/* number of concurrent sequential writers tracked per file */
+#define EXT21_ALLOC_STREAMS	4
+
+struct ext21_block_alloc_info {
+	struct ext21_alloc_stream	streams[EXT21_ALLOC_STREAMS];
+	/* stream picked by ext21_select_alloc_stream() for this allocation */
+	struct ext21_alloc_stream	*cur_stream;
+	/* bumped on every allocation, to find the least recently used stream */
+	unsigned long			alloc_seq;
 };
 
 #define rsv_start rsv_window._rsv_start
@@ -77,8 +103,7 @@ struct ext21_sb_info {
 	unsigned long s_gdb_count;	/* Number of group descriptor blocks */
 	unsigned long s_desc_per_block;	/* Number of group descriptors per block */
 	unsigned long s_groups_count;	/* Number of groups in the fs */
-	unsigned long s_overhead_last;  /* Last calculated overhead */
-	unsigned long s_blocks_last;    /* Last seen block count */
+	unsigned long s_overhead_last;  /* Overhead reported by statfs */
 	struct buffer_head * s_sbh;	/* Buffer containing the super block */
 	struct ext21_super_block * s_es;	/* Pointer to the super block in the buffer */
 	struct buffer_head ** s_group_desc;
@@ -95,7 +120,17 @@ struct ext21_sb_info {
 	spinlock_t s_next_gen_lock;
 	u32 s_next_generation;
 	unsigned long s_dir_count;
+	unsigned long s_stripe;		/* RAID full stripe width, in blocks */
+	unsigned long s_stride;		/* RAID chunk size, in blocks */
+	unsigned long s_smallfile_blocks; /* pack files below this size */
+	unsigned long s_dir_prealloc;	/* first window of a directory */
 	u8 *s_debts;
+	/*
+	 * free block count of every group, kept here instead of in the
+	 * shared descriptor blocks and folded back by ext21_sync_super();
+	 * protected by the group's sb_bgl_lock
+	 */
+	unsigned short *s_group_free_blocks;
 	struct percpu_counter s_freeblocks_counter;
 	struct percpu_counter s_freeinodes_counter;
 	struct percpu_counter s_dirs_counter;
@@ -104,10 +139,40 @@ struct ext21_sb_info {
 	spinlock_t s_rsv_window_lock;
 	struct rb_root s_rsv_window_root;
 	struct ext21_reserve_window_node s_rsv_window_head;
+	/*
+	 * inodes holding on to allocation state (reservation windows) while
+	 * nobody writes them; released by the shrinker on memory pressure
+	 */
+	spinlock_t s_retained_lock;
+	struct list_head s_retained_list;
+	unsigned long s_retained_count;
+	struct shrinker s_retained_shrinker;
+	/* where the next EXT21_ALLOC_PROPORTIONAL region goes; under s_lock */
+	ext21_fsblk_t s_prop_next;
+	/* background read of the block bitmaps (prefetch_bitmaps) */
+	struct super_block *s_sb;
+	struct work_struct s_bitmap_warm_work;
+	/* releases recycled blocks nobody reused (reuse_truncated) */
+	struct delayed_work s_recycle_work;
+	/* releases what the retained inodes hold when space runs out */
+	struct work_struct s_release_work;
+	/*
+	 * deleted files being freed in the background, in the order of the
+	 * on-disk list from s_last_orphan; see orphan.c
+	 */
+	struct mutex s_orphan_lock;
+	struct list_head s_orphan_list;
+	struct delayed_work s_orphan_work;
+	bool s_orphan_stopped;		/* remounting read-only */
+	/* inodes with cached block mappings, see mapcache.c */
+	spinlock_t s_map_lock;
+	struct list_head s_map_list;
+	atomic_long_t s_map_count;	/* cached extents */
+	struct shrinker s_map_shrinker;
 	/*
 	 * s_lock protects against concurrent modifications of s_mount_state,
-	 * s_blocks_last, s_overhead_last and the content of superblock's
-	 * buffer pointed to by sbi->s_es.
+	 * s_overhead_last and the content of superblock's buffer pointed to
+	 * by sbi->s_es.  statfs reads s_overhead_last without it.
 	 *
 	 * Note: It is used in ext21_show_options() to provide a consistent view
 	 * of the mount options.
@@ -132,7 +197,34 @@ sb_bgl_lock(struct ext21_sb_info *sbi, unsigned int block_group)
 #define EXT21_DEFAULT_RESERVE_BLOCKS     8
 /*max window size: 1024(direct blocks) + 3([t,d]indirect blocks) */
 #define EXT21_MAX_RESERVE_BLOCKS         1027
+/* growth limit for the windows of large, sequentially written files */
+#define EXT21_MAX_LARGE_RESERVE_BLOCKS   8192
+/* growth limit for the windows of directories (dir_prealloc=) */
+#define EXT21_MAX_DIR_RESERVE_BLOCKS     64
 #define EXT21_RESERVE_WINDOW_NOT_ALLOCATED 0
+
+/*
+ * Blocks a file was truncated to zero from (reuse_truncated), kept for a
+ * rewrite of the same file
+ */
+struct ext21_recycle_extent {
+	struct list_head	list;
+	ext21_fsblk_t		start;
+	unsigned long		len;
+};
+
+#define EXT21_RECYCLE_GRACE		(30 * HZ)
+#define EXT21_RECYCLE_MAX_EXTENTS	1024
+
+/*
+ * Deleted files of at least this many blocks are freed in the background
+ * (defer_delete), this many blocks of file offset at a time
+ */
+#define EXT21_DEFER_DELETE_BLOCKS	32768
+#define EXT21_DEFER_DELETE_CHUNK	32768
+/* when to look again at deleted files that are still open */
+#define EXT21_DEFER_DELETE_RETRY	(5 * HZ)
+
 /*
  * The second extended file system version
  */
@@ -221,6 +313,8 @@ struct ext21_group_desc
 #define	EXT21_DIND_BLOCK			(EXT21_IND_BLOCK + 1)
 #define	EXT21_TIND_BLOCK			(EXT21_DIND_BLOCK + 1)
 #define	EXT21_N_BLOCKS			(EXT21_TIND_BLOCK + 1)
+/* indirect blocks read ahead of a sequential reader */
+#define	EXT21_IND_READAHEAD		4
 
 /*
  * Inode flags (GETFLAGS/SETFLAGS)
@@ -247,8 +341,10 @@ struct ext21_group_desc
 #define EXT21_DIRSYNC_FL			FS_DIRSYNC_FL	/* dirsync behaviour (directories only) */
 #define EXT21_TOPDIR_FL			FS_TOPDIR_FL	/* Top of directory hierarchies*/
 #define EXT21_RESERVED_FL		FS_RESERVED_FL	/* reserved for ext21 lib */
+#define EXT21_EXTENTS_FL			FS_EXTENT_FL	/* Inode uses extents */
 
-#define EXT21_FL_USER_VISIBLE		FS_FL_USER_VISIBLE	/* User visible flags */
+#define EXT21_FL_USER_VISIBLE		(FS_FL_USER_VISIBLE | \
+					 EXT21_EXTENTS_FL)	/* User visible flags */
 #define EXT21_FL_USER_MODIFIABLE		FS_FL_USER_MODIFIABLE	/* User modifiable flags */
 
 /* Flags that should be inherited by new inodes from their parent. */
@@ -284,6 +380,39 @@ static inline __u32 ext21_mask_flags(umode_t mode, __u32 flags)
 #define	EXT21_IOC_SETVERSION		FS_IOC_SETVERSION
 #define	EXT21_IOC_GETRSVSZ		_IOR('f', 5, long)
 #define	EXT21_IOC_SETRSVSZ		_IOW('f', 6, long)
+#define	EXT21_IOC_GETPLACEMENT		_IOR('f', 7, struct ext21_placement_hint)
+#define	EXT21_IOC_SETPLACEMENT		_IOW('f', 8, struct ext21_placement_hint)
+#define	EXT21_IOC_GETALLOCFLAGS		_IOR('f', 9, int)
+#define	EXT21_IOC_SETALLOCFLAGS		_IOW('f', 10, int)
+
+/*
+ * Placement hint, set with EXT21_IOC_SETPLACEMENT and inherited by the
+ * inodes created in a directory: new inodes and the first data blocks of
+ * a file go to the preferred group range, or next to another inode.  It
+ * is kept in an extended attribute, so that the on-disk inode and
+ * superblock stay as e2fsck knows them.
+ */
+struct ext21_placement_hint {
+	__u32	ph_type;	/* EXT21_PLACE_* */
+	__u32	ph_group;	/* EXT21_PLACE_GROUPS: first preferred group */
+	__u32	ph_ngroups;	/* EXT21_PLACE_GROUPS: number of groups */
+	__u32	ph_ino;		/* EXT21_PLACE_INODE: inode to co-locate with */
+};
+
+#define EXT21_PLACE_NONE		0
+#define EXT21_PLACE_GROUPS		1
+#define EXT21_PLACE_INODE		2
+
+/*
+ * Allocation flags, set with EXT21_IOC_SETALLOCFLAGS and inherited by the
+ * inodes created in a directory.  They are ext21's own, so they are kept
+ * in an extended attribute rather than in i_flags, whose bits e2fsprogs
+ * and the FS_IOC_GETFLAGS users already give a meaning to.
+ */
+#define EXT21_ALLOC_KEEPRSV		0x00000001 /* keep reservation across close */
+#define EXT21_ALLOC_PROPORTIONAL	0x00000002 /* place blocks by file offset */
+#define EXT21_ALLOC_FLAGS		(EXT21_ALLOC_KEEPRSV | \
+					 EXT21_ALLOC_PROPORTIONAL)
 
 /*
  * ioctl commands in 32 bit emulation
@@ -331,7 +460,7 @@ struct ext21_inode {
 			__u16	i_pad1;
 			__le16	l_i_uid_high;	/* these 2 fields    */
 			__le16	l_i_gid_high;	/* were reserved2[0] */
-			__u32	l_i_reserved2;
+			__le32	l_i_reserved2;
 		} linux2;
 		struct {
 			__u8	h_i_frag;	/* Fragment number */
@@ -361,11 +490,43 @@ struct ext21_inode {
 #define i_gid_high	osd2.linux2.l_i_gid_high
 #define i_reserved2	osd2.linux2.l_i_reserved2
 
+/*
+ * Extent tree of an inode with EXT21_EXTENTS_FL: the root lives in
+ * i_block, other nodes fill whole blocks.  Every node starts with a
+ * header and holds entries sorted by logical block: extents in the leaves
+ * (depth 0), index entries pointing one level down in the other nodes.
+ */
+struct ext21_extent_header {
+	__le16	eh_magic;	/* EXT21_EXT_MAGIC */
+	__le16	eh_entries;	/* number of valid entries */
+	__le16	eh_max;		/* capacity of the node */
+	__le16	eh_depth;	/* levels below this node */
+	__le32	eh_generation;
+};
+
+struct ext21_extent {
+	__le32	ee_block;	/* first logical block */
+	__le16	ee_len;		/* number of blocks */
+	__le16	ee_pad;
+	__le32	ee_start;	/* first physical block */
+};
+
+struct ext21_extent_idx {
+	__le32	ei_block;	/* first logical block below */
+	__le32	ei_leaf;	/* physical block of the node below */
+	__le32	ei_pad;
+};
+
+#define EXT21_EXT_MAGIC		0xf30a
+#define EXT21_EXT_MAX_LEN	32768
+#define EXT21_EXT_MAX_DEPTH	5
+
 /*
  * File system states
  */
 #define	EXT21_VALID_FS			0x0001	/* Unmounted cleanly */
 #define	EXT21_ERROR_FS			0x0002	/* Errors detected */
+#define	EXT21_ORPHAN_FS			0x0004	/* Orphans being recovered */
 
 /*
  * Mount flags
@@ -391,6 +552,10 @@ struct ext21_inode {
 #else
 #define EXT21_MOUNT_DAX			0
 #endif
+#define EXT21_MOUNT_KEEPRSV		0x200000  /* Keep reservations across close */
+#define EXT21_MOUNT_PREFETCH_BITMAPS	0x400000  /* Warm block bitmaps at mount */
+#define EXT21_MOUNT_REUSE_TRUNCATED	0x800000  /* Rewrites reuse truncated blocks */
+#define EXT21_MOUNT_DEFER_DELETE	0x1000000 /* Free large deleted files in background */
 
 
 #define clear_opt(o, opt)		o &= ~EXT21_MOUNT_##opt
@@ -476,7 +641,7 @@ struct ext21_super_block {
 	__u8	s_journal_uuid[16];	/* uuid of journal superblock */
 	__u32	s_journal_inum;		/* inode number of journal file */
 	__u32	s_journal_dev;		/* device number of journal file */
-	__u32	s_last_orphan;		/* start of list of inodes to delete */
+	__le32	s_last_orphan;		/* start of list of inodes to delete */
 	__u32	s_hash_seed[4];		/* HTREE hash seed */
 	__u8	s_def_hash_version;	/* Default hash version to use */
 	__u8	s_reserved_char_pad;
@@ -547,11 +712,13 @@ struct ext21_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER		0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV	0x0008
 #define EXT21_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT21_FEATURE_INCOMPAT_EXTENTS		0x0040
 #define EXT21_FEATURE_INCOMPAT_ANY		0xffffffff
 
 #define EXT21_FEATURE_COMPAT_SUPP	EXT21_FEATURE_COMPAT_EXT_ATTR
 #define EXT21_FEATURE_INCOMPAT_SUPP	(EXT21_FEATURE_INCOMPAT_FILETYPE| \
-					 EXT21_FEATURE_INCOMPAT_META_BG)
+					 EXT21_FEATURE_INCOMPAT_META_BG| \
+					 EXT21_FEATURE_INCOMPAT_EXTENTS)
 #define EXT21_FEATURE_RO_COMPAT_SUPP	(EXT21_FEATURE_RO_COMPAT_SPARSE_SUPER| \
 					 EXT21_FEATURE_RO_COMPAT_LARGE_FILE| \
 					 EXT21_FEATURE_RO_COMPAT_BTREE_DIR)
@@ -646,6 +813,10 @@ struct ext21_mount_options {
 	unsigned long s_mount_opt;
 	kuid_t s_resuid;
 	kgid_t s_resgid;
+	unsigned long s_stripe;
+	unsigned long s_stride;
+	unsigned long s_smallfile_blocks;
+	unsigned long s_dir_prealloc;
 };
 
 /*
@@ -674,6 +845,24 @@ struct ext21_inode_info {
 	/* block reservation info */
 	struct ext21_block_alloc_info *i_block_alloc_info;
 
+	/*
+	 * i_pack_goal is where the first blocks of a small file go: next to
+	 * its parent directory's data, as of when the file was created.
+	 * Zero if unknown (the inode was read back from disk).
+	 */
+	ext21_fsblk_t	i_pack_goal;
+	/*
+	 * i_prop_base is where the region of an EXT21_ALLOC_PROPORTIONAL file
+	 * starts, planned at its first allocation or found again from its
+	 * blocks.  Zero if not known yet.
+	 */
+	ext21_fsblk_t	i_prop_base;
+
+	/* placement hint, see EXT21_IOC_SETPLACEMENT */
+	struct ext21_placement_hint i_place;
+	/* EXT21_ALLOC_*, see EXT21_IOC_SETALLOCFLAGS */
+	__u32	i_alloc_flags;
+
 	__u32	i_dir_start_lookup;
 #ifdef CONFIG_EXT21_FS_XATTR
 	/*
@@ -697,13 +886,62 @@ struct ext21_inode_info {
 	 * ext21_reserve_window_node.
 	 */
 	struct mutex truncate_mutex;
+	/*
+	 * i_data_sem protects the extent tree of EXT21_EXTENTS_FL inodes:
+	 * lookups take it shared, changes (made under truncate_mutex)
+	 * exclusive.
+	 */
+	struct rw_semaphore i_data_sem;
 	struct inode	vfs_inode;
-	struct list_head i_orphan;	/* unlinked but open inodes */
+	struct list_head i_orphan;	/* on s_orphan_list */
+	bool i_orphan_pinned;		/* s_orphan_list holds a reference */
+	struct list_head i_retained;	/* on s_retained_list */
+	/*
+	 * blocks kept for a rewrite after truncate (reuse_truncated), sorted
+	 * by block number; protected by truncate_mutex
+	 */
+	struct list_head i_recycle;
+	unsigned int i_recycle_extents;
+	unsigned long i_recycle_expires;
+	bool i_recycling;		/* truncate keeps what it frees */
+	/* quota charged but not allocated yet; protected by truncate_mutex */
+	unsigned long i_quota_credit;
+	/*
+	 * cache of mapped block runs, so that lookups of blocks mapped before
+	 * skip the walk of the block tree; see mapcache.c.  Lookups only
+	 * retry on i_map_lock, they never take it.
+	 */
+	seqlock_t i_map_lock;
+	struct rb_root i_map_tree;
+	unsigned int i_map_count;
+	unsigned int i_map_seq;		/* bumped by invalidation */
+	struct list_head i_map_list;	/* on s_map_list */
+	/*
+	 * byte ranges locked by writers and truncate, in the order they
+	 * asked for them; see rangelock.c
+	 */
+	spinlock_t i_range_lock;
+	struct list_head i_ranges;
+	wait_queue_head_t i_range_wait;
 #ifdef CONFIG_QUOTA
 	struct dquot *i_dquot[MAXQUOTAS];
 #endif
 };
 
+/* a run of mapped blocks, or of hole, found by ext21_map_range() */
+struct ext21_iomap {
+	sector_t m_lblk;		/* first logical block */
+	unsigned long m_len;		/* number of blocks */
+	ext21_fsblk_t m_pblk;		/* first physical block, 0 for a hole */
+};
+
+/* a locked, or wanted, range of bytes [r_start, r_end] of an inode */
+struct ext21_range {
+	struct list_head r_list;	/* on i_ranges */
+	loff_t r_start;
+	loff_t r_end;
+};
+
 #ifdef CONFIG_FS_DAX
 #define dax_sem_down_write(ext21_inode)	down_write(&(ext21_inode)->dax_sem)
 #define dax_sem_up_write(ext21_inode)	up_write(&(ext21_inode)->dax_sem)
@@ -741,6 +979,7 @@ extern ext21_fsblk_t ext21_new_blocks(struct inode *, unsigned long,
 extern void ext21_free_blocks (struct inode *, unsigned long,
 			      unsigned long);
 extern unsigned long ext21_count_free_blocks (struct super_block *);
+extern void ext21_fold_group_counters(struct super_block *);
 extern unsigned long ext21_count_dirs (struct super_block *);
 extern void ext21_check_blocks_bitmap (struct super_block *);
 extern struct ext21_group_desc * ext21_get_group_desc(struct super_block * sb,
@@ -749,7 +988,21 @@ extern struct ext21_group_desc * ext21_get_group_desc(struct super_block * sb,
 extern void ext21_discard_reservation (struct inode *);
 extern int ext21_should_retry_alloc(struct super_block *sb, int *retries);
 extern void ext21_init_block_alloc_info(struct inode *);
+extern struct ext21_alloc_stream *ext21_select_alloc_stream(struct inode *,
+							   unsigned long);
 extern void ext21_rsv_window_add(struct super_block *sb, struct ext21_reserve_window_node *rsv);
+extern void ext21_retain_reservation(struct inode *);
+extern void ext21_forget_retained(struct inode *);
+extern int ext21_recycle_blocks(struct inode *, ext21_fsblk_t, unsigned long);
+extern ext21_fsblk_t ext21_new_recycled_blocks(struct inode *, ext21_fsblk_t,
+					       unsigned long *);
+extern void ext21_release_recycled(struct inode *);
+extern void ext21_release_retained(struct super_block *);
+extern void ext21_release_retained_async(struct super_block *);
+extern void ext21_settle_quota(struct inode *);
+extern void ext21_settle_quota_all(struct super_block *);
+extern int ext21_register_retained_shrinker(struct super_block *);
+extern void ext21_warm_block_bitmaps(struct work_struct *);
 
 /* dir.c */
 extern int ext21_add_link (struct dentry *, struct inode *);
@@ -761,9 +1014,19 @@ extern int ext21_empty_dir (struct inode *);
 extern struct ext21_dir_entry_2 * ext21_dotdot (struct inode *, struct page **);
 extern void ext21_set_link(struct inode *, struct ext21_dir_entry_2 *, struct page *, struct inode *, int);
 
+/* extents.c */
+extern void ext21_ext_tree_init(struct inode *);
+extern int ext21_ext_check_inode(struct inode *);
+extern ext21_fsblk_t ext21_ext_first_block(struct inode *);
+extern int ext21_ext_get_blocks(struct inode *, sector_t, unsigned long,
+				struct buffer_head *, int);
+extern void ext21_ext_truncate(struct inode *, sector_t);
+extern long ext21_ext_hole_blocks(struct inode *, sector_t);
+
 /* ialloc.c */
 extern struct inode * ext21_new_inode (struct inode *, umode_t, const struct qstr *);
 extern void ext21_free_inode (struct inode *);
+extern int ext21_inode_in_use(struct super_block *, unsigned long);
 extern unsigned long ext21_count_free_inodes (struct super_block *);
 extern void ext21_check_inodes_bitmap (struct super_block *);
 extern unsigned long ext21_count_free (struct buffer_head *, unsigned);
@@ -773,19 +1036,60 @@ extern struct inode *ext21_iget (struct super_block *, unsigned long);
 extern int ext21_write_inode (struct inode *, struct writeback_control *);
 extern void ext21_evict_inode(struct inode *);
 extern int ext21_get_block(struct inode *, sector_t, struct buffer_head *, int);
+extern void ext21_start_alloc(struct inode *, long);
+extern ext21_fsblk_t ext21_inode_goal(struct inode *, long);
+extern ext21_fsblk_t ext21_find_near_group(struct inode *);
+extern int ext21_alloc_blocks(struct inode *, ext21_fsblk_t, int, int,
+			      ext21_fsblk_t [4], int *);
+extern void ext21_truncate_free(struct inode *, unsigned long, unsigned long);
+extern void ext21_truncate_blocks(struct inode *, loff_t);
+extern int ext21_dio_overwrite(struct inode *, loff_t, struct iov_iter *);
 extern int ext21_setattr (struct dentry *, struct iattr *);
 extern void ext21_set_inode_flags(struct inode *inode);
 extern void ext21_get_inode_flags(struct ext21_inode_info *);
+extern int ext21_map_range(struct inode *, sector_t, unsigned long,
+			   struct ext21_iomap *);
 extern int ext21_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		       u64 start, u64 len);
+extern loff_t ext21_seek_hole_data(struct inode *, loff_t, int);
 
 /* ioctl.c */
+extern int ext21_valid_placement(struct super_block *,
+				 struct ext21_placement_hint *);
+extern void ext21_load_placement(struct inode *);
+extern int ext21_save_placement(struct inode *, struct ext21_placement_hint *);
+extern void ext21_load_alloc_flags(struct inode *);
+extern int ext21_save_alloc_flags(struct inode *, __u32);
 extern long ext21_ioctl(struct file *, unsigned int, unsigned long);
 extern long ext21_compat_ioctl(struct file *, unsigned int, unsigned long);
 
+/* mapcache.c */
+extern int ext21_map_lookup(struct inode *, sector_t, unsigned long,
+			    ext21_fsblk_t *, unsigned int *);
+extern void ext21_map_insert(struct inode *, sector_t, ext21_fsblk_t,
+			     unsigned long, unsigned int);
+extern void ext21_map_invalidate(struct inode *, sector_t);
+extern int ext21_register_map_shrinker(struct super_block *);
+extern int ext21_init_map_cache(void);
+extern void ext21_destroy_map_cache(void);
+
 /* namei.c */
 struct dentry *ext21_get_parent(struct dentry *child);
 
+/* orphan.c */
+extern void ext21_orphan_add(struct inode *);
+extern void ext21_orphan_del(struct inode *);
+extern void ext21_orphan_release(struct inode *);
+extern void ext21_orphan_work(struct work_struct *);
+extern void ext21_orphan_cleanup(struct super_block *);
+extern void ext21_orphan_stop(struct super_block *);
+extern void ext21_orphan_shutdown(struct super_block *);
+
+/* rangelock.c */
+extern void ext21_range_lock(struct inode *, struct ext21_range *,
+			     loff_t, loff_t);
+extern void ext21_range_unlock(struct inode *, struct ext21_range *);
+
 /* super.c */
 extern __printf(3, 4)
 void ext21_error(struct super_block *, const char *, const char *, ...);
@@ -826,8 +1130,67 @@ ext21_group_first_block_no(struct super_block *sb, unsigned long group_no)
 		le32_to_cpu(EXT21_SB(sb)->s_es->s_first_data_block);
 }
 
+/*
+ * In-memory free block count of a group; the copy in the group descriptor
+ * is only brought up to date when the super block is synced.
+ */
+static inline unsigned int
+ext21_group_free_blocks(struct super_block *sb, unsigned int group)
+{
+	return READ_ONCE(EXT21_SB(sb)->s_group_free_blocks[group]);
+}
+
+/*
+ * Regular files below the smallfile= size get their blocks packed next to
+ * their directory, without a reservation window.
+ */
+static inline int ext21_is_small_file(struct inode *inode)
+{
+	unsigned long blocks = EXT21_SB(inode->i_sb)->s_smallfile_blocks;
+
+	return blocks && S_ISREG(inode->i_mode) &&
+		i_size_read(inode) < ((loff_t)blocks << inode->i_blkbits);
+}
+
+/*
+ * Group whose blocks a file's data should start from: its own, unless a
+ * placement hint points elsewhere.
+ */
+static inline unsigned int ext21_placement_group(struct inode *inode)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_placement_hint *ph = &ei->i_place;
+
+	switch (ph->ph_type) {
+	case EXT21_PLACE_GROUPS:
+		if (ei->i_block_group - ph->ph_group < ph->ph_ngroups)
+			return ei->i_block_group;
+		return ph->ph_group;
+	case EXT21_PLACE_INODE:
+		return (ph->ph_ino - 1) / EXT21_INODES_PER_GROUP(inode->i_sb);
+	}
+	return ei->i_block_group;
+}
+
+/*
+ * Alignment (in blocks) for an allocation or reservation window of @count
+ * blocks: a full RAID stripe when it covers one, else a chunk, else none.
+ */
+static inline unsigned long
+ext21_alloc_align(struct super_block *sb, unsigned long count)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	if (sbi->s_stripe > 1 && count >= sbi->s_stripe)
+		return sbi->s_stripe;
+	if (sbi->s_stride > 1 && count >= sbi->s_stride)
+		return sbi->s_stride;
+	return 1;
+}
+
 #define ext21_set_bit	__test_and_set_bit_le
 #define ext21_clear_bit	__test_and_clear_bit_le
 #define ext21_test_bit	test_bit_le
 #define ext21_find_first_zero_bit	find_first_zero_bit_le
 #define ext21_find_next_zero_bit		find_next_zero_bit_le
+#define ext21_find_next_bit		find_next_bit_le
@@ -0,0 +1,831 @@
+/*
+ * linux/fs/ext21/extents.c
+ *
+ * Extent mapping for files with EXT21_EXTENTS_FL
+ *
+ * The blocks of such a file are described by a tree of (logical,
+ * physical, length) runs rooted in i_data instead of by the indirect
+ * block tree: a contiguous run of up to EXT21_EXT_MAX_LEN blocks takes a
+ * single entry, and truncate visits the tree nodes only, never the data
+ * block numbers one by one.
+ *
+ * Lookups take i_data_sem shared.  Allocation and truncate are serialised
+ * by truncate_mutex, as for indirect files, and take i_data_sem exclusive
+ * around changes to the tree, so that a lookup never sees it half done.
+ */
+
+#include "ext21.h"
+#include <linux/buffer_head.h>
+#include <linux/dax.h>
+#include <linux/slab.h>
+
+#define EXT21_EXT_MAX_BLOCK	0xffffffffUL
+
+/* extents and index entries have the same size and start with their key */
+#define EXT21_EXT_ENTRY_SIZE	sizeof(struct ext21_extent)
+#define EXT21_EXT_ROOT_MAX						\
+	((EXT21_N_BLOCKS * sizeof(__le32) -				\
+	  sizeof(struct ext21_extent_header)) / EXT21_EXT_ENTRY_SIZE)
+#define EXT21_EXT_NODE_MAX(sb)						\
+	(((sb)->s_blocksize - sizeof(struct ext21_extent_header)) /	\
+	 EXT21_EXT_ENTRY_SIZE)
+
+/*
+ * One level of a lookup: the node, and the entry at or before the key
+ * looked up (-1 if the key comes before all of them).
+ */
+struct ext21_ext_path {
+	struct buffer_head		*p_bh;	/* NULL for the root */
+	struct ext21_extent_header	*p_hdr;
+	int				p_pos;
+};
+
+static inline struct ext21_extent_header *ext_inode_hdr(struct inode *inode)
+{
+	return (struct ext21_extent_header *)EXT21_I(inode)->i_data;
+}
+
+static inline struct ext21_extent_header *ext_block_hdr(struct buffer_head *bh)
+{
+	return (struct ext21_extent_header *)bh->b_data;
+}
+
+static inline void *ext_entry(struct ext21_extent_header *eh, int i)
+{
+	return (char *)(eh + 1) + i * EXT21_EXT_ENTRY_SIZE;
+}
+
+static inline struct ext21_extent *ext_extent(struct ext21_extent_header *eh,
+					      int i)
+{
+	return ext_entry(eh, i);
+}
+
+static inline struct ext21_extent_idx *ext_index(struct ext21_extent_header *eh,
+						 int i)
+{
+	return ext_entry(eh, i);
+}
+
+static inline __u32 ext_key(struct ext21_extent_header *eh, int i)
+{
+	return le32_to_cpu(*(__le32 *)ext_entry(eh, i));
+}
+
+static inline int ext_entries(struct ext21_extent_header *eh)
+{
+	return le16_to_cpu(eh->eh_entries);
+}
+
+static inline int ext_depth(struct inode *inode)
+{
+	return le16_to_cpu(ext_inode_hdr(inode)->eh_depth);
+}
+
+/**
+ * ext21_ext_tree_init()
+ * @inode:		new inode
+ *
+ * Start an empty extent tree in i_data.
+ */
+void ext21_ext_tree_init(struct inode *inode)
+{
+	struct ext21_extent_header *eh = ext_inode_hdr(inode);
+
+	BUILD_BUG_ON(sizeof(struct ext21_extent_idx) != EXT21_EXT_ENTRY_SIZE);
+	memset(EXT21_I(inode)->i_data, 0, sizeof(EXT21_I(inode)->i_data));
+	eh->eh_magic = cpu_to_le16(EXT21_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(EXT21_EXT_ROOT_MAX);
+}
+
+static int ext21_ext_check(struct inode *inode,
+			   struct ext21_extent_header *eh, int depth, int max)
+{
+	const char *msg;
+
+	if (le16_to_cpu(eh->eh_magic) != EXT21_EXT_MAGIC)
+		msg = "bad magic";
+	else if (le16_to_cpu(eh->eh_depth) != depth)
+		msg = "unexpected depth";
+	else if (le16_to_cpu(eh->eh_max) != max)
+		msg = "bad capacity";
+	else if (ext_entries(eh) > max)
+		msg = "too many entries";
+	else if (depth && !ext_entries(eh))
+		msg = "empty index node";
+	else
+		return 0;
+
+	ext21_error(inode->i_sb, "ext21_ext_check",
+		    "%s in extent tree of inode %lu, depth %d",
+		    msg, inode->i_ino, depth);
+	return -EIO;
+}
+
+/**
+ * ext21_ext_check_inode()
+ * @inode:		inode read from disk
+ *
+ * Check the root of the extent tree of an inode with EXT21_EXTENTS_FL.
+ */
+int ext21_ext_check_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	int depth = ext_depth(inode);
+
+	if (!EXT21_HAS_INCOMPAT_FEATURE(sb, EXT21_FEATURE_INCOMPAT_EXTENTS)) {
+		ext21_error(sb, "ext21_ext_check_inode",
+			    "inode %lu uses extents but the filesystem "
+			    "does not have the feature", inode->i_ino);
+		return -EIO;
+	}
+	if (depth > EXT21_EXT_MAX_DEPTH) {
+		ext21_error(sb, "ext21_ext_check_inode",
+			    "extent tree of inode %lu too deep (%d)",
+			    inode->i_ino, depth);
+		return -EIO;
+	}
+	return ext21_ext_check(inode, ext_inode_hdr(inode), depth,
+			       EXT21_EXT_ROOT_MAX);
+}
+
+/* last entry whose key is not after @block, -1 if there is none */
+static int ext21_ext_search(struct ext21_extent_header *eh, __u32 block)
+{
+	int lo = 0, hi = ext_entries(eh) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ext_key(eh, mid) <= block)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+static void ext21_ext_drop_path(struct ext21_ext_path *path)
+{
+	int i;
+
+	for (i = 1; path[i].p_hdr; i++)
+		brelse(path[i].p_bh);
+	kfree(path);
+}
+
+/*
+ * Walk down the tree towards @block.  The path has an entry per level,
+ * root first, and is terminated by one with a NULL header.
+ */
+static struct ext21_ext_path *ext21_ext_find(struct inode *inode,
+					     __u32 block)
+{
+	struct ext21_extent_header *eh = ext_inode_hdr(inode);
+	int depth = ext_depth(inode);
+	struct ext21_ext_path *path;
+	struct buffer_head *bh;
+	int i, pos, err;
+
+	path = kcalloc(depth + 2, sizeof(*path), GFP_NOFS);
+	if (!path)
+		return ERR_PTR(-ENOMEM);
+
+	path[0].p_hdr = eh;
+	for (i = 0; i < depth; i++) {
+		/* keys before the first entry still go down the first one */
+		pos = max(ext21_ext_search(eh, block), 0);
+		path[i].p_pos = pos;
+		bh = sb_bread(inode->i_sb,
+			      le32_to_cpu(ext_index(eh, pos)->ei_leaf));
+		if (!bh) {
+			err = -EIO;
+			goto fail;
+		}
+		eh = ext_block_hdr(bh);
+		path[i + 1].p_bh = bh;
+		path[i + 1].p_hdr = eh;
+		err = ext21_ext_check(inode, eh, depth - i - 1,
+				      EXT21_EXT_NODE_MAX(inode->i_sb));
+		if (err)
+			goto fail;
+	}
+	path[depth].p_pos = ext21_ext_search(eh, block);
+	return path;
+
+fail:
+	ext21_ext_drop_path(path);
+	return ERR_PTR(err);
+}
+
+/* first logical block mapped after the leaf entry of @path */
+static unsigned long ext21_ext_next_key(struct ext21_ext_path *path,
+					int depth)
+{
+	int i;
+
+	for (i = depth; i >= 0; i--) {
+		if (path[i].p_pos + 1 < ext_entries(path[i].p_hdr))
+			return ext_key(path[i].p_hdr, path[i].p_pos + 1);
+	}
+	return EXT21_EXT_MAX_BLOCK;
+}
+
+static void ext21_ext_dirty(struct inode *inode, struct ext21_ext_path *path,
+			    int lvl)
+{
+	struct buffer_head *bh = path[lvl].p_bh;
+
+	if (!bh) {
+		mark_inode_dirty(inode);
+		return;
+	}
+	mark_buffer_dirty_inode(bh, inode);
+	if (S_ISDIR(inode->i_mode) && IS_DIRSYNC(inode))
+		sync_dirty_buffer(bh);
+}
+
+/* the first key of the node at @lvl changed: update the index above */
+static void ext21_ext_fix_keys(struct inode *inode,
+			       struct ext21_ext_path *path, int lvl)
+{
+	__le32 key = cpu_to_le32(ext_key(path[lvl].p_hdr, 0));
+
+	while (lvl-- > 0) {
+		ext_index(path[lvl].p_hdr, path[lvl].p_pos)->ei_block = key;
+		ext21_ext_dirty(inode, path, lvl);
+		if (path[lvl].p_pos)
+			break;
+	}
+}
+
+/**
+ * ext21_ext_first_block()
+ * @inode:		inode
+ *
+ * Return the first physical block of the file, or 0 if it has none.
+ */
+ext21_fsblk_t ext21_ext_first_block(struct inode *inode)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_ext_path *path;
+	struct ext21_extent_header *eh;
+	ext21_fsblk_t block = 0;
+
+	down_read(&ei->i_data_sem);
+	path = ext21_ext_find(inode, 0);
+	if (!IS_ERR(path)) {
+		eh = path[ext_depth(inode)].p_hdr;
+		if (ext_entries(eh))
+			block = le32_to_cpu(ext_extent(eh, 0)->ee_start);
+		ext21_ext_drop_path(path);
+	}
+	up_read(&ei->i_data_sem);
+	return block;
+}
+
+/*
+ * Map @iblock: returns the number of mapped blocks from there on, at most
+ * @maxblocks, with the first one in *pblk, 0 for a hole, or an error.
+ */
+static int ext21_ext_lookup(struct inode *inode, __u32 iblock,
+			    unsigned long maxblocks, ext21_fsblk_t *pblk)
+{
+	struct ext21_ext_path *path;
+	struct ext21_extent_header *eh;
+	struct ext21_extent *ex;
+	u64 end;
+	int depth, count = 0;
+
+	path = ext21_ext_find(inode, iblock);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+
+	depth = ext_depth(inode);
+	eh = path[depth].p_hdr;
+	if (path[depth].p_pos >= 0) {
+		ex = ext_extent(eh, path[depth].p_pos);
+		end = (u64)le32_to_cpu(ex->ee_block) + le16_to_cpu(ex->ee_len);
+		if (iblock < end) {
+			*pblk = le32_to_cpu(ex->ee_start) +
+				(iblock - le32_to_cpu(ex->ee_block));
+			count = min_t(u64, maxblocks, end - iblock);
+		}
+	}
+	ext21_ext_drop_path(path);
+	return count;
+}
+
+/*
+ * Goal for blocks at @iblock when the inode's allocation state has none:
+ * continue the extent on the left at the offset of @iblock, or place the
+ * blocks before the extent on the right, or near the leaf.
+ */
+static ext21_fsblk_t ext21_ext_find_goal(struct inode *inode,
+				struct ext21_ext_path *path, __u32 iblock)
+{
+	int depth = ext_depth(inode);
+	struct ext21_extent_header *eh = path[depth].p_hdr;
+	struct ext21_extent *ex;
+	__u32 gap;
+
+	if (path[depth].p_pos >= 0) {
+		ex = ext_extent(eh, path[depth].p_pos);
+		return le32_to_cpu(ex->ee_start) +
+			(iblock - le32_to_cpu(ex->ee_block));
+	}
+	if (ext_entries(eh)) {
+		ex = ext_extent(eh, 0);
+		gap = le32_to_cpu(ex->ee_block) - iblock;
+		if (le32_to_cpu(ex->ee_start) > gap)
+			return le32_to_cpu(ex->ee_start) - gap;
+	}
+	if (path[depth].p_bh)
+		return path[depth].p_bh->b_blocknr;
+	return ext21_find_near_group(inode);
+}
+
+/* put @rec at @pos of the node at @lvl, which has room for it */
+static void ext21_ext_insert_at(struct inode *inode,
+				struct ext21_ext_path *path, int lvl, int pos,
+				void *rec)
+{
+	struct ext21_extent_header *eh = path[lvl].p_hdr;
+
+	memmove(ext_entry(eh, pos + 1), ext_entry(eh, pos),
+		(ext_entries(eh) - pos) * EXT21_EXT_ENTRY_SIZE);
+	memcpy(ext_entry(eh, pos), rec, EXT21_EXT_ENTRY_SIZE);
+	le16_add_cpu(&eh->eh_entries, 1);
+	ext21_ext_dirty(inode, path, lvl);
+	if (pos == 0)
+		ext21_ext_fix_keys(inode, path, lvl);
+}
+
+/*
+ * Split the full node at @lvl: the entries from @pos on move to the new
+ * node in @bh, and @rec goes in at @pos.  When appending, the full node
+ * is left alone and @rec starts the new one, so that files written in
+ * order get full nodes.  Fills in @idx to link the new node.
+ */
+static void ext21_ext_split(struct inode *inode, struct ext21_ext_path *path,
+			    int lvl, int pos, void *rec,
+			    struct buffer_head *bh, struct ext21_extent_idx *idx)
+{
+	struct ext21_extent_header *eh = path[lvl].p_hdr;
+	struct ext21_extent_header *neh = ext_block_hdr(bh);
+	int n = ext_entries(eh);
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	neh->eh_magic = cpu_to_le16(EXT21_EXT_MAGIC);
+	neh->eh_max = cpu_to_le16(EXT21_EXT_NODE_MAX(inode->i_sb));
+	neh->eh_depth = eh->eh_depth;
+	if (pos == n) {
+		memcpy(ext_entry(neh, 0), rec, EXT21_EXT_ENTRY_SIZE);
+		neh->eh_entries = cpu_to_le16(1);
+	} else {
+		memcpy(ext_entry(neh, 0), ext_entry(eh, pos),
+		       (n - pos) * EXT21_EXT_ENTRY_SIZE);
+		neh->eh_entries = cpu_to_le16(n - pos);
+		eh->eh_entries = cpu_to_le16(pos);
+		ext21_ext_insert_at(inode, path, lvl, pos, rec);
+	}
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	if (S_ISDIR(inode->i_mode) && IS_DIRSYNC(inode))
+		sync_dirty_buffer(bh);
+
+	idx->ei_block = cpu_to_le32(ext_key(neh, 0));
+	idx->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	idx->ei_pad = 0;
+}
+
+/*
+ * Move the root into a new block and leave an index to that block as the
+ * only entry of the root: the tree gets one level deeper.
+ */
+static int ext21_ext_grow(struct inode *inode)
+{
+	struct ext21_extent_header *root = ext_inode_hdr(inode);
+	struct ext21_extent_header *neh;
+	struct ext21_extent_idx *idx;
+	struct buffer_head *bh;
+	ext21_fsblk_t goal, block;
+	__u32 key = 0;
+	int err;
+
+	if (ext_depth(inode) >= EXT21_EXT_MAX_DEPTH)
+		return -EFBIG;
+
+	/* next to what the root points to */
+	goal = le32_to_cpu(ext_depth(inode) ? ext_index(root, 0)->ei_leaf :
+					       ext_extent(root, 0)->ee_start);
+	block = ext21_new_block(inode, goal, &err);
+	if (err)
+		return err;
+	bh = sb_getblk(inode->i_sb, block);
+	if (unlikely(!bh)) {
+		ext21_free_blocks(inode, block, 1);
+		return -ENOMEM;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	neh = ext_block_hdr(bh);
+	memcpy(neh, root, sizeof(*root) + ext_entries(root) *
+						EXT21_EXT_ENTRY_SIZE);
+	neh->eh_max = cpu_to_le16(EXT21_EXT_NODE_MAX(inode->i_sb));
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	if (S_ISDIR(inode->i_mode) && IS_DIRSYNC(inode))
+		sync_dirty_buffer(bh);
+	brelse(bh);
+
+	if (ext_entries(root))
+		key = ext_key(root, 0);
+	idx = ext_index(root, 0);
+	idx->ei_block = cpu_to_le32(key);
+	idx->ei_leaf = cpu_to_le32(block);
+	idx->ei_pad = 0;
+	root->eh_entries = cpu_to_le16(1);
+	le16_add_cpu(&root->eh_depth, 1);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Insert the extent @rec after the leaf entry of *@ppath.  Full nodes on
+ * the way up are split, and the tree grows when the root is full too;
+ * the new nodes are allocated before anything changes, so a failure
+ * leaves the tree as it was.  *@ppath may be looked up again.
+ */
+static int ext21_ext_insert_entry(struct inode *inode,
+				  struct ext21_ext_path **ppath,
+				  struct ext21_extent *rec)
+{
+	struct ext21_ext_path *path = *ppath;
+	struct buffer_head *bh[EXT21_EXT_MAX_DEPTH];
+	struct ext21_extent_idx idx;
+	ext21_fsblk_t goal, block;
+	__u32 key = le32_to_cpu(rec->ee_block);
+	void *entry = rec;
+	int depth, lvl, nr, i, err;
+
+	for (;;) {
+		depth = ext_depth(inode);
+		/* lowest level with room; the full nodes below get split */
+		for (lvl = depth; lvl >= 0; lvl--)
+			if (ext_entries(path[lvl].p_hdr) <
+			    le16_to_cpu(path[lvl].p_hdr->eh_max))
+				break;
+		if (lvl >= 0)
+			break;
+		err = ext21_ext_grow(inode);
+		if (err)
+			return err;
+		ext21_ext_drop_path(path);
+		path = *ppath = ext21_ext_find(inode, key);
+		if (IS_ERR(path)) {
+			*ppath = NULL;
+			return PTR_ERR(path);
+		}
+	}
+
+	nr = depth - lvl;
+	goal = path[depth].p_bh ? path[depth].p_bh->b_blocknr :
+				  le32_to_cpu(rec->ee_start);
+	for (i = 0; i < nr; i++) {
+		block = ext21_new_block(inode, goal, &err);
+		if (!err) {
+			bh[i] = sb_getblk(inode->i_sb, block);
+			if (unlikely(!bh[i])) {
+				ext21_free_blocks(inode, block, 1);
+				err = -ENOMEM;
+			}
+		}
+		if (err) {
+			while (i--) {
+				block = bh[i]->b_blocknr;
+				bforget(bh[i]);
+				ext21_free_blocks(inode, block, 1);
+			}
+			return err;
+		}
+		goal = block + 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ext21_ext_split(inode, path, depth - i,
+				path[depth - i].p_pos + 1, entry, bh[i], &idx);
+		brelse(bh[i]);
+		entry = &idx;
+	}
+	ext21_ext_insert_at(inode, path, lvl, path[lvl].p_pos + 1, entry);
+	return 0;
+}
+
+/*
+ * Record @len blocks from @pblk at @iblock, merging with the extents
+ * around if the blocks continue them.
+ */
+static int ext21_ext_insert(struct inode *inode, struct ext21_ext_path **ppath,
+			    __u32 iblock, ext21_fsblk_t pblk, unsigned long len)
+{
+	struct ext21_ext_path *path = *ppath;
+	int depth = ext_depth(inode);
+	struct ext21_extent_header *eh = path[depth].p_hdr;
+	int pos = path[depth].p_pos;
+	struct ext21_extent *ex, *next = NULL;
+	struct ext21_extent newex;
+	unsigned long elen;
+
+	if (pos + 1 < ext_entries(eh))
+		next = ext_extent(eh, pos + 1);
+
+	/* append to the extent on the left */
+	if (pos >= 0) {
+		ex = ext_extent(eh, pos);
+		elen = le16_to_cpu(ex->ee_len);
+		if (le32_to_cpu(ex->ee_block) + elen == iblock &&
+		    le32_to_cpu(ex->ee_start) + elen == pblk &&
+		    elen + len <= EXT21_EXT_MAX_LEN) {
+			elen += len;
+			/* filled the hole up to the next one exactly? */
+			if (next && iblock + len == le32_to_cpu(next->ee_block) &&
+			    pblk + len == le32_to_cpu(next->ee_start) &&
+			    elen + le16_to_cpu(next->ee_len) <= EXT21_EXT_MAX_LEN) {
+				elen += le16_to_cpu(next->ee_len);
+				memmove(next, next + 1, (ext_entries(eh) - pos - 2) *
+							EXT21_EXT_ENTRY_SIZE);
+				le16_add_cpu(&eh->eh_entries, -1);
+			}
+			ex->ee_len = cpu_to_le16(elen);
+			ext21_ext_dirty(inode, path, depth);
+			return 0;
+		}
+	}
+
+	/* prepend to the extent on the right */
+	if (next && iblock + len == le32_to_cpu(next->ee_block) &&
+	    pblk + len == le32_to_cpu(next->ee_start) &&
+	    le16_to_cpu(next->ee_len) + len <= EXT21_EXT_MAX_LEN) {
+		next->ee_block = cpu_to_le32(iblock);
+		next->ee_start = cpu_to_le32(pblk);
+		le16_add_cpu(&next->ee_len, len);
+		ext21_ext_dirty(inode, path, depth);
+		if (pos + 1 == 0)
+			ext21_ext_fix_keys(inode, path, depth);
+		return 0;
+	}
+
+	newex.ee_block = cpu_to_le32(iblock);
+	newex.ee_len = cpu_to_le16(len);
+	newex.ee_pad = 0;
+	newex.ee_start = cpu_to_le32(pblk);
+	return ext21_ext_insert_entry(inode, ppath, &newex);
+}
+
+/*
+ * Allocate blocks for the hole at @iblock, up to @maxblocks and never
+ * past the next extent, and add them to the tree.  Called with
+ * truncate_mutex held.  Returns the number of blocks, the first in *pblk.
+ */
+static int ext21_ext_allocate(struct inode *inode, __u32 iblock,
+			      unsigned long maxblocks, ext21_fsblk_t *pblk)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_block_alloc_info *block_i;
+	struct ext21_ext_path *path;
+	ext21_fsblk_t goal, new_blocks[4];
+	unsigned long next;
+	int count, err = 0;
+
+	path = ext21_ext_find(inode, iblock);
+	if (IS_ERR(path))
+		return PTR_ERR(path);
+
+	next = ext21_ext_next_key(path, ext_depth(inode));
+	maxblocks = min(maxblocks, next - iblock);
+	maxblocks = min_t(unsigned long, maxblocks, EXT21_EXT_MAX_LEN);
+
+	ext21_start_alloc(inode, iblock);
+	goal = ext21_inode_goal(inode, iblock);
+	if (!goal)
+		goal = ext21_ext_find_goal(inode, path, iblock);
+
+	count = ext21_alloc_blocks(inode, goal, 0, maxblocks, new_blocks, &err);
+	if (err)
+		goto out;
+	*pblk = new_blocks[0];
+
+	if (IS_DAX(inode)) {
+		/*
+		 * blocks must be initialised before we put them in the tree
+		 * so that they are not found by another thread before that
+		 */
+		err = dax_clear_sectors(inode->i_sb->s_bdev,
+				*pblk << (inode->i_blkbits - 9),
+				count << inode->i_blkbits);
+		if (err)
+			goto out_free;
+	}
+
+	down_write(&ei->i_data_sem);
+	err = ext21_ext_insert(inode, &path, iblock, *pblk, count);
+	up_write(&ei->i_data_sem);
+	if (err)
+		goto out_free;
+
+	/* help ext21_inode_goal() with the next allocation of the stream */
+	block_i = ei->i_block_alloc_info;
+	if (block_i) {
+		block_i->cur_stream->last_alloc_logical_block =
+							iblock + count - 1;
+		block_i->cur_stream->last_alloc_physical_block =
+							*pblk + count - 1;
+	}
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	goto out;
+
+out_free:
+	ext21_free_blocks(inode, *pblk, count);
+out:
+	if (path)
+		ext21_ext_drop_path(path);
+	return err ? err : count;
+}
+
+/**
+ * ext21_ext_get_blocks()
+ * @inode:		inode with EXT21_EXTENTS_FL
+ * @iblock:		first logical block
+ * @maxblocks:		number of blocks wanted
+ * @bh_result:		buffer to map
+ * @create:		allocate blocks for a hole
+ *
+ * The extent counterpart of ext21_get_blocks(), with the same return
+ * convention: the number of blocks mapped, 0 for a hole when @create is
+ * not set, or a negative error.
+ */
+int ext21_ext_get_blocks(struct inode *inode, sector_t iblock,
+			 unsigned long maxblocks,
+			 struct buffer_head *bh_result, int create)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	ext21_fsblk_t pblk = 0;
+	int count;
+
+	if (iblock >= EXT21_EXT_MAX_BLOCK)
+		return -EIO;
+
+	down_read(&ei->i_data_sem);
+	count = ext21_ext_lookup(inode, iblock, maxblocks, &pblk);
+	up_read(&ei->i_data_sem);
+	if (count || !create)
+		goto mapped;
+
+	mutex_lock(&ei->truncate_mutex);
+	/* somebody may have allocated the blocks meanwhile */
+	count = ext21_ext_lookup(inode, iblock, maxblocks, &pblk);
+	if (!count) {
+		count = ext21_ext_allocate(inode, iblock, maxblocks, &pblk);
+		mutex_unlock(&ei->truncate_mutex);
+		if (count > 0) {
+			set_buffer_new(bh_result);
+			map_bh(bh_result, inode->i_sb, pblk);
+		}
+		return count;
+	}
+	mutex_unlock(&ei->truncate_mutex);
+mapped:
+	if (count > 0) {
+		clear_buffer_new(bh_result);
+		map_bh(bh_result, inode->i_sb, pblk);
+	}
+	return count;
+}
+
+/*
+ * Cut the last leaf down to the blocks before @start, and unlink it and
+ * the index nodes above it that this leaves empty.  Returns 1 once there
+ * is nothing more to cut.
+ */
+static int ext21_ext_trim_last(struct inode *inode,
+			       struct ext21_ext_path *path, __u32 start)
+{
+	int depth = ext_depth(inode);
+	struct ext21_extent_header *eh = path[depth].p_hdr;
+	struct ext21_extent *ex;
+	int n = ext_entries(eh), lvl;
+	__u32 block, len, pblk;
+	ext21_fsblk_t nr;
+
+	while (n > 0) {
+		ex = ext_extent(eh, n - 1);
+		block = le32_to_cpu(ex->ee_block);
+		len = le16_to_cpu(ex->ee_len);
+		pblk = le32_to_cpu(ex->ee_start);
+		if ((u64)block + len <= start)
+			break;
+		if (block >= start) {
+			ext21_truncate_free(inode, pblk, len);
+			n--;
+			continue;
+		}
+		ext21_truncate_free(inode, pblk + (start - block),
+				    block + len - start);
+		ex->ee_len = cpu_to_le16(start - block);
+		break;
+	}
+	eh->eh_entries = cpu_to_le16(n);
+	ext21_ext_dirty(inode, path, depth);
+	if (n || !depth)
+		return 1;
+
+	/* the leaf is empty: drop it, and any index node left empty */
+	for (lvl = depth; lvl > 0; lvl--) {
+		nr = path[lvl].p_bh->b_blocknr;
+		bforget(path[lvl].p_bh);
+		path[lvl].p_bh = NULL;
+		ext21_free_blocks(inode, nr, 1);
+		eh = path[lvl - 1].p_hdr;
+		le16_add_cpu(&eh->eh_entries, -1);
+		ext21_ext_dirty(inode, path, lvl - 1);
+		if (ext_entries(eh))
+			return 0;
+	}
+	/* all gone */
+	ext21_ext_tree_init(inode);
+	mark_inode_dirty(inode);
+	return 1;
+}
+
+/**
+ * ext21_ext_truncate()
+ * @inode:		inode with EXT21_EXTENTS_FL
+ * @start:		first logical block to free
+ *
+ * Free the blocks of the file from @start on, last extent first, and the
+ * tree nodes that become empty.  Called with truncate_mutex held.
+ */
+void ext21_ext_truncate(struct inode *inode, sector_t start)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_ext_path *path;
+	int done = 0;
+
+	if (start >= EXT21_EXT_MAX_BLOCK)
+		return;
+
+	down_write(&ei->i_data_sem);
+	while (!done) {
+		path = ext21_ext_find(inode, EXT21_EXT_MAX_BLOCK);
+		if (IS_ERR(path))
+			break;
+		done = ext21_ext_trim_last(inode, path, start);
+		ext21_ext_drop_path(path);
+	}
+	up_write(&ei->i_data_sem);
+}
+
+/**
+ * ext21_ext_hole_blocks()
+ * @inode:		inode with EXT21_EXTENTS_FL
+ * @iblock:		logical block in a hole
+ *
+ * Returns the number of blocks from @iblock up to the next extent, 0 if
+ * @iblock turns out to be mapped after all, or a negative error.
+ */
+long ext21_ext_hole_blocks(struct inode *inode, sector_t iblock)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_ext_path *path;
+	struct ext21_extent *ex;
+	unsigned long next;
+	int depth, pos;
+
+	if (iblock >= EXT21_EXT_MAX_BLOCK)
+		return -EIO;
+
+	down_read(&ei->i_data_sem);
+	path = ext21_ext_find(inode, iblock);
+	if (IS_ERR(path)) {
+		up_read(&ei->i_data_sem);
+		return PTR_ERR(path);
+	}
+	depth = ext_depth(inode);
+	pos = path[depth].p_pos;
+	next = ext21_ext_next_key(path, depth);
+	if (pos >= 0) {
+		ex = ext_extent(path[depth].p_hdr, pos);
+		if (iblock < (u64)le32_to_cpu(ex->ee_block) +
+			     le16_to_cpu(ex->ee_len))
+			next = iblock;
+	}
+	ext21_ext_drop_path(path);
+	up_read(&ei->i_data_sem);
+
+	return min_t(u64, next - iblock, LONG_MAX);
+}
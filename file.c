@@ -20,6 +20,8 @@
 
 #include <linux/time.h>
 #include <linux/pagemap.h>
+#include <linux/backing-dev.h>
+#include <linux/uio.h>
 #include <linux/dax.h>
 #include <linux/quotaops.h>
 #include "ext21.h"
@@ -134,9 +136,25 @@ static int ext21_release_file (struct inode * inode, struct file * filp)
 {
 	if (filp->f_mode & FMODE_WRITE) {
 		mutex_lock(&EXT21_I(inode)->truncate_mutex);
-		ext21_discard_reservation(inode);
+		/*
+		 * Files reopened for every batch of appends (loggers) keep
+		 * their window, so the next batch lands right after this one.
+		 */
+		if (test_opt(inode->i_sb, KEEPRSV) ||
+		    (EXT21_I(inode)->i_alloc_flags & EXT21_ALLOC_KEEPRSV))
+			ext21_retain_reservation(inode);
+		else
+			ext21_discard_reservation(inode);
+		/*
+		 * The last writer has had its chance to rewrite the blocks
+		 * kept from truncate; the rest go back now.
+		 */
+		if (atomic_read(&inode->i_writecount) == 1)
+			ext21_release_recycled(inode);
 		mutex_unlock(&EXT21_I(inode)->truncate_mutex);
 	}
+	/* a deleted file may be the worker's to free now */
+	ext21_orphan_release(inode);
 	return 0;
 }
 
@@ -156,14 +174,190 @@ int ext21_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	return ret;
 }
 
+/*
+ * SEEK_HOLE and SEEK_DATA find the holes in the block map, instead of
+ * taking the whole file for data as generic_file_llseek() does.
+ */
+static loff_t ext21_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	switch (whence) {
+	case SEEK_HOLE:
+	case SEEK_DATA:
+		inode_lock(inode);
+		offset = ext21_seek_hole_data(inode, offset, whence);
+		inode_unlock(inode);
+		if (offset < 0)
+			return offset;
+		return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+}
+
+/*
+ * Buffered part of ext21_file_write_iter(), called with i_mutex held and
+ * the range written locked.  A write that ends within i_size changes
+ * nothing i_mutex protects once the times and privileges are updated, so
+ * it copies without i_mutex; returns with i_mutex dropped either way.
+ */
+static ssize_t ext21_buffered_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	bool in_place;
+	ssize_t ret;
+
+	current->backing_dev_info = inode_to_bdi(inode);
+	ret = file_remove_privs(file);
+	if (!ret)
+		ret = file_update_time(file);
+	if (ret) {
+		inode_unlock(inode);
+		goto out;
+	}
+
+	in_place = !IS_DAX(inode) &&
+		   iocb->ki_pos + iov_iter_count(from) <= i_size_read(inode);
+	if (in_place)
+		inode_unlock(inode);
+	ret = generic_perform_write(file, from, iocb->ki_pos);
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	if (!in_place)
+		inode_unlock(inode);
+out:
+	current->backing_dev_info = NULL;
+	return ret;
+}
+
+/*
+ * Direct part of ext21_file_write_iter() for a write that only overwrites
+ * allocated blocks within i_size (see ext21_dio_overwrite()), called with
+ * i_mutex held and the range written locked.  Such a write changes nothing
+ * i_mutex protects once the times and privileges are updated and the page
+ * cache over the range is written back, so the I/O goes without i_mutex:
+ * the range lock keeps other writers off the pages and blocks, and truncate
+ * waits in inode_dio_wait().  Returns with i_mutex dropped, or -ENOTBLK
+ * with i_mutex still held if the page cache over the range could not be
+ * invalidated, for the caller to write through it.
+ */
+static ssize_t ext21_direct_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	loff_t pos = iocb->ki_pos;
+	loff_t end = pos + iov_iter_count(from) - 1;
+	struct iov_iter data;
+	ssize_t ret;
+
+	ret = file_remove_privs(file);
+	if (!ret)
+		ret = file_update_time(file);
+	if (!ret)
+		ret = filemap_write_and_wait_range(mapping, pos, end);
+	if (!ret && mapping->nrpages) {
+		ret = invalidate_inode_pages2_range(mapping,
+				pos >> PAGE_CACHE_SHIFT, end >> PAGE_CACHE_SHIFT);
+		/* mapped and dirtied again: let the caller write it buffered */
+		if (ret == -EBUSY)
+			return -ENOTBLK;
+	}
+	if (ret) {
+		inode_unlock(inode);
+		return ret;
+	}
+
+	inode_dio_begin(inode);
+	inode_unlock(inode);
+
+	data = *from;
+	ret = mapping->a_ops->direct_IO(iocb, &data, pos);
+
+	/*
+	 * Readahead or a fault may have brought pages back in meanwhile;
+	 * the range lock, not i_mutex, keeps writes to them out.
+	 */
+	if (mapping->nrpages)
+		invalidate_inode_pages2_range(mapping,
+				pos >> PAGE_CACHE_SHIFT, end >> PAGE_CACHE_SHIFT);
+	inode_dio_end(inode);
+
+	if (ret > 0) {
+		iov_iter_advance(from, ret);
+		iocb->ki_pos = pos + ret;
+	}
+	return ret;
+}
+
+/*
+ * generic_file_write_iter(), except that writers of one file, such as a
+ * database writing to its heap files, need not wait for each other.
+ * Every write locks the pages it writes (see rangelock.c), and
+ *
+ * - buffered writes that stay within i_size do without i_mutex while
+ *   they copy;
+ * - direct writes which only overwrite allocated blocks within i_size do
+ *   without i_mutex for the I/O itself.
+ *
+ * Other writes keep i_mutex throughout, the buffered fallback of a direct
+ * write included, and never take it again once dropped: the range is
+ * locked under i_mutex, so a range holder must not wait for it.
+ */
+static ssize_t ext21_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct ext21_range range;
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0) {
+		inode_unlock(inode);
+		goto out;
+	}
+
+	/*
+	 * Whole pages: with blocks smaller than a page, a buffered write
+	 * next to a direct one would read and write back the other's block.
+	 */
+	ext21_range_lock(inode, &range, round_down(iocb->ki_pos, PAGE_SIZE),
+			 round_up(iocb->ki_pos + ret, PAGE_SIZE) - 1);
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = -ENOTBLK;
+		if (ext21_dio_overwrite(inode, iocb->ki_pos, from))
+			ret = ext21_direct_write(iocb, from);
+		if (ret == -ENOTBLK) {
+			ret = __generic_file_write_iter(iocb, from);
+			inode_unlock(inode);
+		}
+	} else {
+		ret = ext21_buffered_write(iocb, from);
+	}
+	ext21_range_unlock(inode, &range);
+
+out:
+	if (ret > 0) {
+		ssize_t err;
+
+		err = generic_write_sync(file, iocb->ki_pos - ret, ret);
+		if (err < 0)
+			ret = err;
+	}
+	return ret;
+}
+
 /*
  * We have mostly NULL's here: the current defaults are ok for
  * the ext21 filesystem.
  */
 const struct file_operations ext21_file_operations = {
-	.llseek		= generic_file_llseek,
+	.llseek		= ext21_file_llseek,
 	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
+	.write_iter	= ext21_file_write_iter,
 	.unlocked_ioctl = ext21_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= ext21_compat_ioctl,
@@ -215,8 +215,8 @@ static int find_group_dir(struct super_block *sb, struct inode *parent)
 		if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
 			continue;
 		if (!best_desc || 
-		    (le16_to_cpu(desc->bg_free_blocks_count) >
-		     le16_to_cpu(best_desc->bg_free_blocks_count))) {
+		    (ext21_group_free_blocks(sb, group) >
+		     ext21_group_free_blocks(sb, best_group))) {
 			best_group = group;
 			best_desc = desc;
 		}
@@ -295,7 +295,7 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 				continue;
 			if (le16_to_cpu(desc->bg_free_inodes_count) < avefreei)
 				continue;
-			if (le16_to_cpu(desc->bg_free_blocks_count) < avefreeb)
+			if (ext21_group_free_blocks(sb, group) < avefreeb)
 				continue;
 			best_group = group;
 			best_ndir = le16_to_cpu(desc->bg_used_dirs_count);
@@ -337,7 +337,7 @@ static int find_group_orlov(struct super_block *sb, struct inode *parent)
 			continue;
 		if (le16_to_cpu(desc->bg_free_inodes_count) < min_inodes)
 			continue;
-		if (le16_to_cpu(desc->bg_free_blocks_count) < min_blocks)
+		if (ext21_group_free_blocks(sb, group) < min_blocks)
 			continue;
 		goto found;
 	}
@@ -380,7 +380,7 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 	group = parent_group;
 	desc = ext21_get_group_desc (sb, group, NULL);
 	if (desc && le16_to_cpu(desc->bg_free_inodes_count) &&
-			le16_to_cpu(desc->bg_free_blocks_count))
+			ext21_group_free_blocks(sb, group))
 		goto found;
 
 	/*
@@ -404,7 +404,7 @@ static int find_group_other(struct super_block *sb, struct inode *parent)
 			group -= ngroups;
 		desc = ext21_get_group_desc (sb, group, NULL);
 		if (desc && le16_to_cpu(desc->bg_free_inodes_count) &&
-				le16_to_cpu(desc->bg_free_blocks_count))
+				ext21_group_free_blocks(sb, group))
 			goto found;
 	}
 
@@ -427,6 +427,55 @@ found:
 	return group;
 }
 
+/*
+ * Honour the placement hint of the parent (see EXT21_IOC_SETPLACEMENT).
+ * Files stay in the parent's group when it is one of the preferred groups;
+ * directories go to the preferred group with the most free blocks.  A hint
+ * to co-locate with an inode means that inode's group.  Returns -1 when
+ * there is no hint or none of its groups has room, and the usual policy
+ * is used.
+ */
+static int find_group_hint(struct super_block *sb, struct inode *parent,
+			   umode_t mode)
+{
+	struct ext21_placement_hint *ph = &EXT21_I(parent)->i_place;
+	unsigned int parent_group = EXT21_I(parent)->i_block_group;
+	struct ext21_group_desc *desc;
+	unsigned int first, count, i;
+	int group, best_group = -1;
+
+	switch (ph->ph_type) {
+	case EXT21_PLACE_GROUPS:
+		first = ph->ph_group;
+		count = ph->ph_ngroups;
+		break;
+	case EXT21_PLACE_INODE:
+		first = (ph->ph_ino - 1) / EXT21_INODES_PER_GROUP(sb);
+		count = 1;
+		break;
+	default:
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* start from the parent's group if it is in the range */
+		if (parent_group - first < count)
+			group = first + (parent_group - first + i) % count;
+		else
+			group = first + i;
+		desc = ext21_get_group_desc(sb, group, NULL);
+		if (!desc || !desc->bg_free_inodes_count ||
+		    !ext21_group_free_blocks(sb, group))
+			continue;
+		if (!S_ISDIR(mode))
+			return group;
+		if (best_group < 0 || ext21_group_free_blocks(sb, group) >
+				      ext21_group_free_blocks(sb, best_group))
+			best_group = group;
+	}
+	return best_group;
+}
+
 struct inode *ext21_new_inode(struct inode *dir, umode_t mode,
 			     const struct qstr *qstr)
 {
@@ -450,13 +499,16 @@ struct inode *ext21_new_inode(struct inode *dir, umode_t mode,
 	ei = EXT21_I(inode);
 	sbi = EXT21_SB(sb);
 	es = sbi->s_es;
-	if (S_ISDIR(mode)) {
-		if (test_opt(sb, OLDALLOC))
-			group = find_group_dir(sb, dir);
-		else
-			group = find_group_orlov(sb, dir);
-	} else 
-		group = find_group_other(sb, dir);
+	group = find_group_hint(sb, dir, mode);
+	if (group == -1) {
+		if (S_ISDIR(mode)) {
+			if (test_opt(sb, OLDALLOC))
+				group = find_group_dir(sb, dir);
+			else
+				group = find_group_orlov(sb, dir);
+		} else
+			group = find_group_other(sb, dir);
+	}
 
 	if (group == -1) {
 		err = -ENOSPC;
@@ -555,6 +607,12 @@ got:
 	memset(ei->i_data, 0, sizeof(ei->i_data));
 	ei->i_flags =
 		ext21_mask_flags(mode, EXT21_I(dir)->i_flags & EXT21_FL_INHERITED);
+	/* new files and directories map their blocks with extents */
+	if (EXT21_HAS_INCOMPAT_FEATURE(sb, EXT21_FEATURE_INCOMPAT_EXTENTS) &&
+	    (S_ISREG(mode) || S_ISDIR(mode))) {
+		ei->i_flags |= EXT21_EXTENTS_FL;
+		ext21_ext_tree_init(inode);
+	}
 	ei->i_faddr = 0;
 	ei->i_frag_no = 0;
 	ei->i_frag_size = 0;
@@ -562,6 +620,20 @@ got:
 	ei->i_dir_acl = 0;
 	ei->i_dtime = 0;
 	ei->i_block_alloc_info = NULL;
+	if (S_ISREG(mode) || S_ISDIR(mode)) {
+		ei->i_place = EXT21_I(dir)->i_place;
+		ei->i_alloc_flags = EXT21_I(dir)->i_alloc_flags;
+	} else {
+		memset(&ei->i_place, 0, sizeof(ei->i_place));
+		ei->i_alloc_flags = 0;
+	}
+	/* small files of a directory are packed next to its data */
+	if (!S_ISREG(mode))
+		ei->i_pack_goal = 0;
+	else if (EXT21_I(dir)->i_flags & EXT21_EXTENTS_FL)
+		ei->i_pack_goal = ext21_ext_first_block(dir);
+	else
+		ei->i_pack_goal = le32_to_cpu(EXT21_I(dir)->i_data[0]);
 	ei->i_block_group = group;
 	ei->i_dir_start_lookup = 0;
 	ei->i_state = EXT21_STATE_NEW;
@@ -593,6 +665,14 @@ got:
 	if (err)
 		goto fail_free_drop;
 
+	/* hints are only advice: go without those that cannot be kept */
+	if (ei->i_place.ph_type != EXT21_PLACE_NONE &&
+	    ext21_save_placement(inode, &ei->i_place))
+		memset(&ei->i_place, 0, sizeof(ei->i_place));
+	if (ei->i_alloc_flags &&
+	    ext21_save_alloc_flags(inode, ei->i_alloc_flags))
+		ei->i_alloc_flags = 0;
+
 	mark_inode_dirty(inode);
 	ext21_debug("allocating inode %lu\n", inode->i_ino);
 	ext21_preread_inode(inode);
@@ -615,6 +695,29 @@ fail:
 	return ERR_PTR(err);
 }
 
+/**
+ * ext21_inode_in_use()
+ * @sb:			super block
+ * @ino:		inode number, checked by the caller
+ *
+ * Returns 1 if @ino is allocated in the inode bitmap, 0 if it is free, or
+ * -EIO if the bitmap cannot be read.
+ */
+int ext21_inode_in_use(struct super_block *sb, unsigned long ino)
+{
+	unsigned long block_group = (ino - 1) / EXT21_INODES_PER_GROUP(sb);
+	unsigned long bit = (ino - 1) % EXT21_INODES_PER_GROUP(sb);
+	struct buffer_head *bitmap_bh;
+	int ret;
+
+	bitmap_bh = read_inode_bitmap(sb, block_group);
+	if (!bitmap_bh)
+		return -EIO;
+	ret = ext21_test_bit(bit, bitmap_bh->b_data) ? 1 : 0;
+	brelse(bitmap_bh);
+	return ret;
+}
+
 unsigned long ext21_count_free_inodes (struct super_block * sb)
 {
 	struct ext21_group_desc *desc;
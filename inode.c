@@ -33,6 +33,8 @@
 #include <linux/fiemap.h>
 #include <linux/namei.h>
 #include <linux/uio.h>
+#include <linux/math64.h>
+#include <linux/blkdev.h>
 #include "ext21.h"
 #include "acl.h"
 #include "xattr.h"
@@ -51,7 +53,6 @@ static inline int ext21_inode_is_fast_symlink(struct inode *inode)
 		inode->i_blocks - ea_blocks == 0);
 }
 
-static void ext21_truncate_blocks(struct inode *inode, loff_t offset);
 
 static void ext21_write_failed(struct address_space *mapping, loff_t to)
 {
@@ -71,6 +72,9 @@ void ext21_evict_inode(struct inode * inode)
 	struct ext21_block_alloc_info *rsv;
 	int want_delete = 0;
 
+	/* while the dquots are still attached */
+	ext21_settle_quota(inode);
+
 	if (!inode->i_nlink && !is_bad_inode(inode)) {
 		want_delete = 1;
 		dquot_initialize(inode);
@@ -82,6 +86,8 @@ void ext21_evict_inode(struct inode * inode)
 
 	if (want_delete) {
 		sb_start_intwrite(inode->i_sb);
+		/* i_dtime links the orphan list until now */
+		ext21_orphan_del(inode);
 		/* set dtime */
 		EXT21_I(inode)->i_dtime	= get_seconds();
 		mark_inode_dirty(inode);
@@ -96,6 +102,9 @@ void ext21_evict_inode(struct inode * inode)
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 
+	ext21_forget_retained(inode);
+	ext21_map_invalidate(inode, 0);
+	ext21_release_recycled(inode);
 	ext21_discard_reservation(inode);
 	rsv = EXT21_I(inode)->i_block_alloc_info;
 	EXT21_I(inode)->i_block_alloc_info = NULL;
@@ -268,6 +277,54 @@ no_block:
 	return p;
 }
 
+/**
+ *	ext21_readahead_branch - prefetch the indirect blocks a reader needs next
+ *	@inode: inode in question
+ *	@chain: chain of the block mapped last, as from ext21_get_branch()
+ *	@depth: depth of the chain
+ *
+ *	Called when a lookup has mapped up to the end of an indirect block
+ *	(or of the direct blocks), which is what sequential readers do: the
+ *	next EXT21_IND_READAHEAD indirect blocks of the same level are read
+ *	without waiting for them, and when that runs past the end of the block
+ *	above, the next block of that level as well.  The stream then finds
+ *	them in the cache instead of stalling in sb_bread() at each boundary.
+ *	The pointers are read without locks; they are hints only.
+ */
+static void ext21_readahead_branch(struct inode *inode, Indirect *chain,
+				   int depth)
+{
+	struct super_block *sb = inode->i_sb;
+	__le32 *i_data = EXT21_I(inode)->i_data;
+	int n = EXT21_IND_READAHEAD;
+	__le32 *p, *end;
+	int k;
+
+	if (depth == 1) {
+		if (i_data[EXT21_IND_BLOCK])
+			sb_breadahead(sb, le32_to_cpu(i_data[EXT21_IND_BLOCK]));
+		return;
+	}
+
+	for (k = depth - 2; k >= 0; k--) {
+		if (k) {
+			end = (__le32 *)chain[k].bh->b_data +
+				EXT21_ADDR_PER_BLOCK(sb);
+		} else {
+			/* only the root of the next tree */
+			end = i_data + EXT21_N_BLOCKS;
+			n = 1;
+		}
+		for (p = chain[k].p + 1; p < end && n; p++, n--)
+			if (*p)
+				sb_breadahead(sb, le32_to_cpu(*p));
+		if (p < end)
+			break;
+		/* nearing the end of the block above: the next one of its level */
+		n = 1;
+	}
+}
+
 /**
  *	ext21_find_near - find a place for allocation with sufficient locality
  *	@inode: owner
@@ -293,8 +350,6 @@ static ext21_fsblk_t ext21_find_near(struct inode *inode, Indirect *ind)
 	struct ext21_inode_info *ei = EXT21_I(inode);
 	__le32 *start = ind->bh ? (__le32 *) ind->bh->b_data : ei->i_data;
 	__le32 *p;
-	ext21_fsblk_t bg_start;
-	ext21_fsblk_t colour;
 
 	/* Try to find previous block */
 	for (p = ind->p - 1; p >= start; p--)
@@ -305,14 +360,123 @@ static ext21_fsblk_t ext21_find_near(struct inode *inode, Indirect *ind)
 	if (ind->bh)
 		return ind->bh->b_blocknr;
 
+	return ext21_find_near_group(inode);
+}
+
+/**
+ *	ext21_find_near_group - goal for the first blocks of a file
+ *	@inode: owner
+ *
+ *	Used when no block of the file gives a hint yet, for the indirect
+ *	as well as the extent mapping: next to the directory for small
+ *	files, otherwise the placement group coloured by the caller's PID.
+ */
+ext21_fsblk_t ext21_find_near_group(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	unsigned long stripe = EXT21_SB(sb)->s_stripe;
+	ext21_fsblk_t bg_start, bg_end;
+	ext21_fsblk_t colour, goal;
+
+	/* pack small files of a directory together, first fit */
+	if (ei->i_pack_goal && ext21_is_small_file(inode))
+		return ei->i_pack_goal;
+
 	/*
 	 * It is going to be referred from inode itself? OK, just put it into
 	 * the same cylinder group then.
 	 */
-	bg_start = ext21_group_first_block_no(inode->i_sb, ei->i_block_group);
-	colour = (current->pid % 16) *
-			(EXT21_BLOCKS_PER_GROUP(inode->i_sb) / 16);
-	return bg_start + colour;
+	bg_start = ext21_group_first_block_no(sb, ext21_placement_group(inode));
+	/* the last group may be short */
+	bg_end = min_t(ext21_fsblk_t, bg_start + EXT21_BLOCKS_PER_GROUP(sb),
+		       le32_to_cpu(EXT21_SB(sb)->s_es->s_blocks_count));
+	colour = (current->pid % 16) * (EXT21_BLOCKS_PER_GROUP(sb) / 16);
+	goal = bg_start + colour;
+	if (goal >= bg_end)
+		goal = bg_start;
+	/*
+	 * start new files on a stripe boundary of a striped device, the one
+	 * before if the one after is past the end of the group
+	 */
+	if (stripe > 1) {
+		if (roundup(goal, stripe) < bg_end)
+			goal = roundup(goal, stripe);
+		else if (rounddown(goal, stripe) >= bg_start)
+			goal = rounddown(goal, stripe);
+	}
+	return goal;
+}
+
+/*
+ * Plan the region of a proportional file of @nblocks blocks.  A file that
+ * has blocks already keeps the region they are in.  A new one gets the
+ * next region that nobody planned since mount, from its placement group
+ * on, so that the images in one directory do not fight for the same
+ * blocks.
+ */
+static ext21_fsblk_t ext21_plan_proportional(struct inode *inode,
+					     u64 nblocks)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	ext21_fsblk_t first = le32_to_cpu(sbi->s_es->s_first_data_block);
+	ext21_fsblk_t count = le32_to_cpu(sbi->s_es->s_blocks_count);
+	ext21_fsblk_t start;
+	struct ext21_iomap map;
+	sector_t block = 0;
+
+	while (block < nblocks) {
+		if (ext21_map_range(inode, block, nblocks - block, &map))
+			break;
+		if (map.m_pblk)
+			return max(first, map.m_pblk - min_t(ext21_fsblk_t,
+						map.m_pblk, map.m_lblk));
+		block += map.m_len;
+	}
+
+	/* a file not sized yet gets a group's worth at least */
+	nblocks = max_t(u64, nblocks, EXT21_BLOCKS_PER_GROUP(sb));
+	start = ext21_group_first_block_no(sb, ext21_placement_group(inode));
+	spin_lock(&sbi->s_lock);
+	if (sbi->s_prop_next > start && sbi->s_prop_next + nblocks <= count)
+		start = sbi->s_prop_next;
+	sbi->s_prop_next = min_t(u64, start + nblocks, count);
+	spin_unlock(&sbi->s_lock);
+	return start;
+}
+
+/**
+ *	ext21_find_proportional - goal at the file offset within a region
+ *	@inode: owner
+ *	@block: block we want
+ *
+ *	For files with EXT21_ALLOC_PROPORTIONAL (VM images, databases)
+ *	that are written in random order.  Each file has a region of its own, planned
+ *	at its first allocation, and the goal is @block blocks into it,
+ *	scaled down when the file is larger than the rest of the disk, so
+ *	that the physical order of the blocks follows their logical order
+ *	whatever order they are written in.  Sizing the file up front
+ *	(ftruncate) plans the whole region.
+ */
+static ext21_fsblk_t ext21_find_proportional(struct inode *inode, long block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	ext21_fsblk_t start, region;
+	u64 nblocks;
+
+	nblocks = (i_size_read(inode) + sb->s_blocksize - 1) >>
+						sb->s_blocksize_bits;
+	if (nblocks <= block)
+		nblocks = block + 1;
+	if (!ei->i_prop_base)
+		ei->i_prop_base = ext21_plan_proportional(inode, nblocks);
+	start = ei->i_prop_base;
+	region = le32_to_cpu(EXT21_SB(sb)->s_es->s_blocks_count) - start;
+	if (nblocks <= region)
+		return start + block;
+	return start + div64_u64((u64)block * region, nblocks);
 }
 
 /**
@@ -326,21 +490,61 @@ static ext21_fsblk_t ext21_find_near(struct inode *inode, Indirect *ind)
 
 static inline ext21_fsblk_t ext21_find_goal(struct inode *inode, long block,
 					  Indirect *partial)
+{
+	ext21_fsblk_t goal = ext21_inode_goal(inode, block);
+
+	if (goal)
+		return goal;
+	return ext21_find_near(inode, partial);
+}
+
+/**
+ *	ext21_inode_goal - goal from the allocation state of the inode
+ *	@inode: owner
+ *	@block:  block we want
+ *
+ *	Blocks kept from a truncate, offset placement and the sequential
+ *	heuristic of the current stream, for both the indirect and the
+ *	extent mapping.  Returns 0 if none of them applies.
+ */
+ext21_fsblk_t ext21_inode_goal(struct inode *inode, long block)
 {
 	struct ext21_block_alloc_info *block_i;
+	struct ext21_alloc_stream *stream;
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_recycle_extent *ext;
 
-	block_i = EXT21_I(inode)->i_block_alloc_info;
+	block_i = ei->i_block_alloc_info;
 
 	/*
-	 * try the heuristic for sequential allocation,
-	 * failing that at least try to get decent locality.
+	 * blocks kept from truncating this file go back in the order they
+	 * were laid out; once the grace period is over they go back to the
+	 * filesystem instead
 	 */
-	if (block_i && (block == block_i->last_alloc_logical_block + 1)
-		&& (block_i->last_alloc_physical_block != 0)) {
-		return block_i->last_alloc_physical_block + 1;
+	if (!list_empty(&ei->i_recycle)) {
+		if (time_before(jiffies, ei->i_recycle_expires)) {
+			ext = list_first_entry(&ei->i_recycle,
+					struct ext21_recycle_extent, list);
+			return ext->start;
+		}
+		ext21_release_recycled(inode);
 	}
 
-	return ext21_find_near(inode, partial);
+	if (ei->i_alloc_flags & EXT21_ALLOC_PROPORTIONAL)
+		return ext21_find_proportional(inode, block);
+
+	/*
+	 * try the heuristic for sequential allocation within the current
+	 * stream, failing that at least try to get decent locality.
+	 */
+	if (block_i) {
+		stream = block_i->cur_stream;
+		if ((block == stream->last_alloc_logical_block + 1)
+			&& (stream->last_alloc_physical_block != 0))
+			return stream->last_alloc_physical_block + 1;
+	}
+
+	return 0;
 }
 
 /**
@@ -366,7 +570,7 @@ ext21_blks_to_allocate(Indirect * branch, int k, unsigned long blks,
 	 * then it's clear blocks on that path have not allocated
 	 */
 	if (k > 0) {
-		/* right now don't hanel cross boundary allocation */
+		/* ext21_get_blocks() goes on past the boundary by itself */
 		if (blks < blocks_to_boundary + 1)
 			count += blks;
 		else
@@ -392,7 +596,7 @@ ext21_blks_to_allocate(Indirect * branch, int k, unsigned long blks,
  *	@blks:	on return it will store the total number of allocated
  *		direct blocks
  */
-static int ext21_alloc_blocks(struct inode *inode,
+int ext21_alloc_blocks(struct inode *inode,
 			ext21_fsblk_t goal, int indirect_blks, int blks,
 			ext21_fsblk_t new_blocks[4], int *err)
 {
@@ -415,9 +619,29 @@ static int ext21_alloc_blocks(struct inode *inode,
 	while (1) {
 		count = target;
 		/* allocating blocks for indirect blocks and direct blocks */
-		current_block = ext21_new_blocks(inode,goal,&count,err);
-		if (*err)
-			goto failed_out;
+		current_block = 0;
+		if (!list_empty(&EXT21_I(inode)->i_recycle))
+			current_block = ext21_new_recycled_blocks(inode, goal,
+								  &count);
+		if (!current_block) {
+			current_block = ext21_new_blocks(inode,goal,&count,err);
+			/*
+			 * blocks held for rewrites count as used; give ours
+			 * back before failing, and let the worker release
+			 * those of other inodes for the next try
+			 */
+			if (*err == -ENOSPC) {
+				ext21_release_retained_async(inode->i_sb);
+				if (!list_empty(&EXT21_I(inode)->i_recycle)) {
+					ext21_release_recycled(inode);
+					count = target;
+					current_block = ext21_new_blocks(inode,
+							goal, &count, err);
+				}
+			}
+			if (*err)
+				goto failed_out;
+		}
 
 		target -= count;
 		/* allocate blocks for indirect blocks */
@@ -428,6 +652,8 @@ static int ext21_alloc_blocks(struct inode *inode,
 
 		if (count > 0)
 			break;
+		/* continue where this run ended */
+		goal = current_block;
 	}
 
 	/* save the new block number for the first direct block */
@@ -445,6 +671,45 @@ failed_out:
 	return ret;
 }
 
+/**
+ *	ext21_alloc_contig_blocks: allocate a branch continuing a run
+ *	@goal: block right after the run
+ *
+ *	Like ext21_alloc_blocks(), for a branch whose direct blocks continue
+ *	the run of blocks mapped by the previous indirect block: they must
+ *	start at @goal, else we give them back and fail with -EAGAIN.  The
+ *	indirect blocks go after them, where ext21_alloc_blocks() would have
+ *	put them in the middle of the run.
+ */
+static int ext21_alloc_contig_blocks(struct inode *inode,
+			ext21_fsblk_t goal, int indirect_blks, int blks,
+			ext21_fsblk_t new_blocks[4], int *err)
+{
+	ext21_fsblk_t data[4];
+	int num, i;
+
+	num = ext21_alloc_blocks(inode, goal, 0, blks, data, err);
+	if (*err)
+		return 0;
+	if (data[0] != goal) {
+		ext21_free_blocks(inode, data[0], num);
+		*err = -EAGAIN;
+		return 0;
+	}
+
+	for (i = 0; i < indirect_blks; i++) {
+		new_blocks[i] = ext21_new_block(inode, goal + num + i, err);
+		if (*err) {
+			while (i--)
+				ext21_free_blocks(inode, new_blocks[i], 1);
+			ext21_free_blocks(inode, data[0], num);
+			return 0;
+		}
+	}
+	new_blocks[indirect_blks] = data[0];
+	return num;
+}
+
 /**
  *	ext21_alloc_branch - allocate and set up a chain of blocks.
  *	@inode: owner
@@ -468,11 +733,14 @@ failed_out:
  *	their buffer_heads) and return the error value the from failed
  *	ext21_alloc_block() (normally -ENOSPC). Otherwise we set the chain
  *	as described above and return 0.
+ *
+ *	With @contig the direct blocks must start at @goal, or we return
+ *	-EAGAIN; see ext21_alloc_contig_blocks().
  */
 
 static int ext21_alloc_branch(struct inode *inode,
 			int indirect_blks, int *blks, ext21_fsblk_t goal,
-			int *offsets, Indirect *branch)
+			int *offsets, Indirect *branch, int contig)
 {
 	int blocksize = inode->i_sb->s_blocksize;
 	int i, n = 0;
@@ -482,8 +750,12 @@ static int ext21_alloc_branch(struct inode *inode,
 	ext21_fsblk_t new_blocks[4];
 	ext21_fsblk_t current_block;
 
-	num = ext21_alloc_blocks(inode, goal, indirect_blks,
-				*blks, new_blocks, &err);
+	if (contig)
+		num = ext21_alloc_contig_blocks(inode, goal, indirect_blks,
+						*blks, new_blocks, &err);
+	else
+		num = ext21_alloc_blocks(inode, goal, indirect_blks,
+					*blks, new_blocks, &err);
 	if (err)
 		return err;
 
@@ -578,12 +850,12 @@ static void ext21_splice_branch(struct inode *inode,
 
 	/*
 	 * update the most recently allocated logical & physical block
-	 * in i_block_alloc_info, to assist find the proper goal block for next
-	 * allocation
+	 * of the current stream, to assist find the proper goal block for
+	 * next allocation
 	 */
 	if (block_i) {
-		block_i->last_alloc_logical_block = block + blks - 1;
-		block_i->last_alloc_physical_block =
+		block_i->cur_stream->last_alloc_logical_block = block + blks - 1;
+		block_i->cur_stream->last_alloc_physical_block =
 				le32_to_cpu(where[num].key) + blks - 1;
 	}
 
@@ -597,6 +869,34 @@ static void ext21_splice_branch(struct inode *inode,
 	mark_inode_dirty(inode);
 }
 
+/**
+ * ext21_start_alloc - set up the allocation state before allocating
+ * @inode: owner
+ * @block: (logical) number of block we are about to allocate
+ *
+ * Lazily initializes the block allocation info of regular files and
+ * growing directories, and picks the stream @block belongs to.  Called
+ * with truncate_mutex held, for the indirect and the extent mapping.
+ */
+void ext21_start_alloc(struct inode *inode, long block)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+
+	if (S_ISREG(inode->i_mode) && (!ei->i_block_alloc_info))
+		ext21_init_block_alloc_info(inode);
+	/*
+	 * Growing directories get windows too, so their blocks stay
+	 * together; nobody closes a directory for writing, so the windows
+	 * wait on the retained list for eviction or memory pressure.
+	 */
+	if (S_ISDIR(inode->i_mode) && EXT21_SB(inode->i_sb)->s_dir_prealloc) {
+		if (!ei->i_block_alloc_info)
+			ext21_init_block_alloc_info(inode);
+		ext21_retain_reservation(inode);
+	}
+	ext21_select_alloc_stream(inode, block);
+}
+
 /*
  * Allocation strategy is simple: if we have to allocate something, we will
  * have to go the whole way to leaf. So let's do it before attaching anything
@@ -611,14 +911,18 @@ static void ext21_splice_branch(struct inode *inode,
  *
  * `handle' can be NULL if create == 0.
  *
+ * This maps or allocates within the indirect block @iblock belongs to; with
+ * @contig set, blocks are only allocated if the data lands right there, and
+ * the new indirect blocks go after it (see ext21_alloc_branch()).
+ *
  * return > 0, # of blocks mapped or allocated.
  * return = 0, if plain lookup failed.
  * return < 0, error case.
  */
-static int ext21_get_blocks(struct inode *inode,
+static int ext21_get_branch_blocks(struct inode *inode,
 			   sector_t iblock, unsigned long maxblocks,
 			   struct buffer_head *bh_result,
-			   int create)
+			   int create, ext21_fsblk_t contig)
 {
 	int err = -EIO;
 	int offsets[4];
@@ -632,8 +936,6 @@ static int ext21_get_blocks(struct inode *inode,
 	int count = 0;
 	ext21_fsblk_t first_block = 0;
 
-	BUG_ON(maxblocks == 0);
-
 	depth = ext21_block_to_path(inode,iblock,offsets,&blocks_to_boundary);
 
 	if (depth == 0)
@@ -666,8 +968,11 @@ static int ext21_get_blocks(struct inode *inode,
 			else
 				break;
 		}
-		if (err != -EAGAIN)
+		if (err != -EAGAIN) {
+			if (count > blocks_to_boundary)
+				ext21_readahead_branch(inode, chain, depth);
 			goto got_it;
+		}
 	}
 
 	/* Next simple case - plain lookup or failed read of indirect block */
@@ -707,10 +1012,9 @@ static int ext21_get_blocks(struct inode *inode,
 	 * Okay, we need to do block allocation.  Lazily initialize the block
 	 * allocation info here if necessary
 	*/
-	if (S_ISREG(inode->i_mode) && (!ei->i_block_alloc_info))
-		ext21_init_block_alloc_info(inode);
+	ext21_start_alloc(inode, iblock);
 
-	goal = ext21_find_goal(inode, iblock, partial);
+	goal = contig ? contig : ext21_find_goal(inode, iblock, partial);
 
 	/* the number of blocks need to allocate for [d,t]indirect blocks */
 	indirect_blks = (chain + depth) - partial - 1;
@@ -724,7 +1028,7 @@ static int ext21_get_blocks(struct inode *inode,
 	 * XXX ???? Block out ext21_truncate while we alter the tree
 	 */
 	err = ext21_alloc_branch(inode, indirect_blks, &count, goal,
-				offsets + (partial - chain), partial);
+				offsets + (partial - chain), partial, contig != 0);
 
 	if (err) {
 		mutex_unlock(&ei->truncate_mutex);
@@ -765,6 +1069,69 @@ cleanup:
 	return err;
 }
 
+/*
+ * Map or allocate up to @maxblocks blocks from @iblock.  A run that goes
+ * on past the end of an indirect block is followed into the next one, so
+ * that large contiguous files get large mappings and bios; allocation
+ * goes on there only while the new blocks continue the run.
+ *
+ * return > 0, # of blocks mapped or allocated.
+ * return = 0, if plain lookup failed.
+ * return < 0, error case.
+ */
+static int ext21_get_blocks(struct inode *inode,
+			   sector_t iblock, unsigned long maxblocks,
+			   struct buffer_head *bh_result,
+			   int create)
+{
+	struct buffer_head next;
+	ext21_fsblk_t first_block = 0;
+	unsigned int map_seq;
+	int count, n;
+
+	BUG_ON(maxblocks == 0);
+
+	/* blocks mapped before need no walk of the tree */
+	count = ext21_map_lookup(inode, iblock, maxblocks, &first_block,
+				 &map_seq);
+	if (count) {
+		clear_buffer_new(bh_result);
+		map_bh(bh_result, inode->i_sb, first_block);
+		return count;
+	}
+
+	if (EXT21_I(inode)->i_flags & EXT21_EXTENTS_FL) {
+		count = ext21_ext_get_blocks(inode, iblock, maxblocks,
+					     bh_result, create);
+		goto out;
+	}
+
+	count = ext21_get_branch_blocks(inode, iblock, maxblocks, bh_result,
+					create, 0);
+	while (count > 0 && count < maxblocks && buffer_boundary(bh_result)) {
+		/*
+		 * One buffer is either all new or all mapped before, so only
+		 * allocate on behind new blocks.
+		 */
+		next.b_state = 0;
+		n = ext21_get_branch_blocks(inode, iblock + count,
+				maxblocks - count, &next,
+				create && buffer_new(bh_result),
+				bh_result->b_blocknr + count);
+		if (n <= 0 || next.b_blocknr != bh_result->b_blocknr + count ||
+		    buffer_new(&next) != buffer_new(bh_result))
+			break;
+		count += n;
+		if (!buffer_boundary(&next))
+			clear_buffer_boundary(bh_result);
+	}
+out:
+	if (count > 0)
+		ext21_map_insert(inode, iblock, bh_result->b_blocknr, count,
+				 map_seq);
+	return count;
+}
+
 int ext21_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
 {
 	unsigned max_blocks = bh_result->b_size >> inode->i_blkbits;
@@ -778,11 +1145,208 @@ int ext21_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh
 
 }
 
+/*
+ * Number of blocks from @iblock on in a hole of the indirect tree: the
+ * rest of the subtree whose pointer is missing, and of the subtrees after
+ * it in the same block with none either.  Returns 0 if @iblock turns out
+ * to be mapped after all, or a negative error.
+ */
+static long ext21_hole_blocks(struct inode *inode, sector_t iblock)
+{
+	struct super_block *sb = inode->i_sb;
+	int ptrs_bits = EXT21_ADDR_PER_BLOCK_BITS(sb);
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+	int depth, level, boundary, i;
+	int err = 0;
+	u64 size, hole = 0;
+	__le32 *p, *end;
+
+	depth = ext21_block_to_path(inode, iblock, offsets, &boundary);
+	if (depth == 0)
+		return -EIO;
+
+	partial = ext21_get_branch(inode, depth, offsets, chain, &err);
+	if (!partial) {
+		partial = chain + depth - 1;
+		goto out;
+	}
+	if (err) {
+		/* the chain changed under us: look again */
+		if (err == -EAGAIN)
+			err = 0;
+		goto out;
+	}
+
+	level = partial - chain;
+	size = 1ULL << ((depth - 1 - level) * ptrs_bits);
+	hole = size;
+	for (i = depth - 1; i > level; i--)
+		hole -= (u64)offsets[i] << ((depth - 1 - i) * ptrs_bits);
+	if (level) {
+		end = (__le32 *)partial->bh->b_data + EXT21_ADDR_PER_BLOCK(sb);
+		for (p = partial->p + 1; p < end && !*p; p++)
+			hole += size;
+	}
+out:
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
+	}
+	if (err)
+		return err;
+	return min_t(u64, hole, LONG_MAX);
+}
+
+/**
+ * ext21_map_range - map the run of blocks, or of hole, at a block
+ * @inode: inode in question
+ * @iblock: first logical block
+ * @maxblocks: most blocks to look at, not 0
+ * @map: the run found
+ *
+ * The extent-at-a-time lookup behind fiemap and SEEK_HOLE/SEEK_DATA:
+ * mapped blocks come from ext21_get_blocks(), a whole run, across
+ * indirect blocks and through the mapping cache, per call; a hole is
+ * measured from the missing indirect block or the gap between extents,
+ * however large it is, rather than block by block.  Allocates nothing.
+ */
+int ext21_map_range(struct inode *inode, sector_t iblock,
+		    unsigned long maxblocks, struct ext21_iomap *map)
+{
+	struct buffer_head bh;
+	long hole;
+	int count;
+
+	maxblocks = min_t(unsigned long, maxblocks, INT_MAX);
+	map->m_lblk = iblock;
+	for (;;) {
+		bh.b_state = 0;
+		count = ext21_get_blocks(inode, iblock, maxblocks, &bh, 0);
+		if (count < 0)
+			return count;
+		if (count > 0) {
+			map->m_len = count;
+			map->m_pblk = bh.b_blocknr;
+			return 0;
+		}
+		if (EXT21_I(inode)->i_flags & EXT21_EXTENTS_FL)
+			hole = ext21_ext_hole_blocks(inode, iblock);
+		else
+			hole = ext21_hole_blocks(inode, iblock);
+		if (hole < 0)
+			return hole;
+		if (hole) {
+			map->m_len = min_t(unsigned long, hole, maxblocks);
+			map->m_pblk = 0;
+			return 0;
+		}
+		/* mapped meanwhile */
+	}
+}
+
 int ext21_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
 		u64 start, u64 len)
 {
-	return generic_block_fiemap(inode, fieinfo, start, len,
-				    ext21_get_block);
+	unsigned int bits = inode->i_blkbits;
+	struct ext21_iomap map, prev = { .m_len = 0 };
+	sector_t block, last, end;
+	int ret;
+
+	ret = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (ret)
+		return ret;
+	if (!len)
+		return 0;
+
+	inode_lock(inode);
+	block = start >> bits;
+	last = (start + len - 1) >> bits;
+	if (start + len - 1 < start)
+		last = ~(sector_t)0;
+	end = (i_size_read(inode) + (1 << bits) - 1) >> bits;
+
+	/*
+	 * A run is only reported once the next one is found, or the end of
+	 * the file reached, so that the last one gets FIEMAP_EXTENT_LAST.
+	 */
+	while (block < end) {
+		ret = ext21_map_range(inode, block, end - block, &map);
+		if (ret)
+			break;
+		block = map.m_lblk + map.m_len;
+		if (!map.m_pblk)
+			continue;
+		if (prev.m_len && prev.m_lblk + prev.m_len == map.m_lblk &&
+		    prev.m_pblk + prev.m_len == map.m_pblk) {
+			prev.m_len += map.m_len;
+			continue;
+		}
+		if (prev.m_len) {
+			ret = fiemap_fill_next_extent(fieinfo,
+					(u64)prev.m_lblk << bits,
+					(u64)prev.m_pblk << bits,
+					(u64)prev.m_len << bits, 0);
+			prev.m_len = 0;
+			if (ret)
+				break;
+		}
+		if (map.m_lblk > last)
+			break;
+		prev = map;
+	}
+	if (!ret && prev.m_len)
+		ret = fiemap_fill_next_extent(fieinfo,
+				(u64)prev.m_lblk << bits,
+				(u64)prev.m_pblk << bits,
+				(u64)prev.m_len << bits, FIEMAP_EXTENT_LAST);
+	inode_unlock(inode);
+	if (ret == 1)
+		ret = 0;
+	return ret;
+}
+
+/**
+ * ext21_seek_hole_data - find the next hole or data for lseek()
+ * @inode: regular file
+ * @offset: where to start looking
+ * @whence: SEEK_HOLE or SEEK_DATA
+ *
+ * Returns the offset found, or -ENXIO if @offset is past the end of the
+ * file, or if there is no data after it.  write() allocates the blocks
+ * it writes to, but a page dirtied through mmap() gets its blocks only
+ * when written back, so the pages after @offset are written back first;
+ * the block map is then all there is to look at.  Called with i_mutex
+ * held.
+ */
+loff_t ext21_seek_hole_data(struct inode *inode, loff_t offset, int whence)
+{
+	unsigned int bits = inode->i_blkbits;
+	loff_t isize = i_size_read(inode);
+	struct ext21_iomap map;
+	sector_t block, end;
+	int err;
+
+	if (offset < 0 || offset >= isize)
+		return -ENXIO;
+
+	err = filemap_write_and_wait_range(inode->i_mapping, offset, isize - 1);
+	if (err)
+		return err;
+
+	block = offset >> bits;
+	end = (isize + (1 << bits) - 1) >> bits;
+	while (block < end) {
+		err = ext21_map_range(inode, block, end - block, &map);
+		if (err)
+			return err;
+		if ((whence == SEEK_DATA) == (map.m_pblk != 0))
+			return max_t(loff_t, offset, (loff_t)block << bits);
+		block += map.m_len;
+	}
+	/* past the last block is a hole up to i_size */
+	return whence == SEEK_DATA ? -ENXIO : isize;
 }
 
 static int ext21_writepage(struct page *page, struct writeback_control *wbc)
@@ -853,6 +1417,45 @@ static sector_t ext21_bmap(struct address_space *mapping, sector_t block)
 	return generic_block_bmap(mapping,block,ext21_get_block);
 }
 
+/**
+ * ext21_dio_overwrite - may a direct write do its I/O without i_mutex?
+ * @inode: inode written to
+ * @pos: offset of the write
+ * @from: data to write
+ *
+ * True if the write is block aligned, ends within i_size and only
+ * overwrites blocks that are allocated already: it then neither
+ * allocates, nor zeroes partial blocks, nor changes i_size, and nothing
+ * in the inode needs i_mutex while the I/O runs.  Called with i_mutex
+ * held.
+ */
+int ext21_dio_overwrite(struct inode *inode, loff_t pos, struct iov_iter *from)
+{
+	unsigned blocksize = 1 << inode->i_blkbits;
+	size_t count = iov_iter_count(from);
+	struct buffer_head bh;
+	sector_t iblock, end;
+	int n;
+
+	if (IS_DAX(inode) || !count)
+		return 0;
+	if ((pos | iov_iter_alignment(from)) & (blocksize - 1))
+		return 0;
+	if (pos + count > i_size_read(inode))
+		return 0;
+
+	iblock = pos >> inode->i_blkbits;
+	end = (pos + count) >> inode->i_blkbits;
+	while (iblock < end) {
+		bh.b_state = 0;
+		n = ext21_get_blocks(inode, iblock, end - iblock, &bh, 0);
+		if (n <= 0)
+			return 0;
+		iblock += n;
+	}
+	return 1;
+}
+
 static ssize_t
 ext21_direct_IO(struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
 {
@@ -1010,6 +1613,18 @@ no_top:
 	return partial;
 }
 
+/*
+ * Free blocks cut off by truncate, or keep them for a rewrite of the file
+ * if __ext21_truncate_blocks() is emptying it under reuse_truncated.
+ */
+void ext21_truncate_free(struct inode *inode, unsigned long block,
+			 unsigned long count)
+{
+	if (!EXT21_I(inode)->i_recycling ||
+	    ext21_recycle_blocks(inode, block, count))
+		ext21_free_blocks(inode, block, count);
+}
+
 /**
  *	ext21_free_data - free a list of data blocks
  *	@inode:	inode we are dealing with
@@ -1035,7 +1650,7 @@ static inline void ext21_free_data(struct inode *inode, __le32 *p, __le32 *q)
 			else if (block_to_free == nr - count)
 				count++;
 			else {
-				ext21_free_blocks (inode, block_to_free, count);
+				ext21_truncate_free(inode, block_to_free, count);
 				mark_inode_dirty(inode);
 			free_this:
 				block_to_free = nr;
@@ -1044,11 +1659,33 @@ static inline void ext21_free_data(struct inode *inode, __le32 *p, __le32 *q)
 		}
 	}
 	if (count > 0) {
-		ext21_free_blocks (inode, block_to_free, count);
+		ext21_truncate_free(inode, block_to_free, count);
 		mark_inode_dirty(inode);
 	}
 }
 
+/**
+ *	ext21_readahead_blocks - start reading an array of indirect blocks
+ *	@sb:	super block
+ *	@p:	array of block numbers
+ *	@q:	pointer immediately past the end of array
+ *
+ *	ext21_free_branches() needs each of these blocks in turn; asking for
+ *	all of them at once, in one plug, lets the reads of a cold file go
+ *	out merged and in parallel instead of one sb_bread() at a time.
+ */
+static void ext21_readahead_blocks(struct super_block *sb, __le32 *p,
+				   __le32 *q)
+{
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	for ( ; p < q ; p++)
+		if (*p)
+			sb_breadahead(sb, le32_to_cpu(*p));
+	blk_finish_plug(&plug);
+}
+
 /**
  *	ext21_free_branches - free an array of branches
  *	@inode:	inode we are dealing with
@@ -1067,6 +1704,7 @@ static void ext21_free_branches(struct inode *inode, __le32 *p, __le32 *q, int d
 
 	if (depth--) {
 		int addr_per_block = EXT21_ADDR_PER_BLOCK(inode->i_sb);
+		ext21_readahead_blocks(inode->i_sb, p, q);
 		for ( ; p < q ; p++) {
 			nr = le32_to_cpu(*p);
 			if (!nr)
@@ -1088,7 +1726,7 @@ static void ext21_free_branches(struct inode *inode, __le32 *p, __le32 *q, int d
 					   (__le32*)bh->b_data + addr_per_block,
 					   depth);
 			bforget(bh);
-			ext21_free_blocks(inode, nr, 1);
+			ext21_truncate_free(inode, nr, 1);
 			mark_inode_dirty(inode);
 		}
 	} else
@@ -1105,7 +1743,7 @@ static void __ext21_truncate_blocks(struct inode *inode, loff_t offset)
 	Indirect chain[4];
 	Indirect *partial;
 	__le32 nr = 0;
-	int n;
+	int n = 0;
 	long iblock;
 	unsigned blocksize;
 	blocksize = inode->i_sb->s_blocksize;
@@ -1115,15 +1753,28 @@ static void __ext21_truncate_blocks(struct inode *inode, loff_t offset)
 	WARN_ON(!rwsem_is_locked(&ei->dax_sem));
 #endif
 
-	n = ext21_block_to_path(inode, iblock, offsets, NULL);
-	if (n == 0)
-		return;
+	if (!(ei->i_flags & EXT21_EXTENTS_FL)) {
+		n = ext21_block_to_path(inode, iblock, offsets, NULL);
+		if (n == 0)
+			return;
+	}
 
 	/*
 	 * From here we block out all ext21_get_block() callers who want to
 	 * modify the block allocation tree.
 	 */
 	mutex_lock(&ei->truncate_mutex);
+	/* no more lookups of what we are about to free from the cache */
+	ext21_map_invalidate(inode, iblock);
+
+	/* a file emptied in place is likely to be written again */
+	ei->i_recycling = !iblock && S_ISREG(inode->i_mode) &&
+		inode->i_nlink && test_opt(inode->i_sb, REUSE_TRUNCATED);
+
+	if (ei->i_flags & EXT21_EXTENTS_FL) {
+		ext21_ext_truncate(inode, iblock);
+		goto out;
+	}
 
 	if (n == 1) {
 		ext21_free_data(inode, i_data+offsets[0],
@@ -1177,13 +1828,16 @@ do_indirects:
 		case EXT21_TIND_BLOCK:
 			;
 	}
-
+out:
+	/* and nothing a lookup found while we were at it */
+	ext21_map_invalidate(inode, iblock);
+	ei->i_recycling = false;
 	ext21_discard_reservation(inode);
 
 	mutex_unlock(&ei->truncate_mutex);
 }
 
-static void ext21_truncate_blocks(struct inode *inode, loff_t offset)
+void ext21_truncate_blocks(struct inode *inode, loff_t offset)
 {
 	/*
 	 * XXX: it seems like a bug here that we don't allow
@@ -1208,6 +1862,7 @@ static void ext21_truncate_blocks(struct inode *inode, loff_t offset)
 
 static int ext21_setsize(struct inode *inode, loff_t newsize)
 {
+	struct ext21_range range;
 	int error;
 
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
@@ -1219,6 +1874,10 @@ static int ext21_setsize(struct inode *inode, loff_t newsize)
 		return -EPERM;
 
 	inode_dio_wait(inode);
+	/* wait for the writers of the pages and blocks truncate touches */
+	ext21_range_lock(inode, &range,
+			 round_down(min(newsize, inode->i_size), PAGE_SIZE),
+			 LLONG_MAX);
 
 	if (IS_DAX(inode))
 		error = dax_truncate_page(inode, newsize, ext21_get_block);
@@ -1228,13 +1887,16 @@ static int ext21_setsize(struct inode *inode, loff_t newsize)
 	else
 		error = block_truncate_page(inode->i_mapping,
 				newsize, ext21_get_block);
-	if (error)
+	if (error) {
+		ext21_range_unlock(inode, &range);
 		return error;
+	}
 
 	dax_sem_down_write(EXT21_I(inode));
 	truncate_setsize(inode, newsize);
 	__ext21_truncate_blocks(inode, newsize);
 	dax_sem_up_write(EXT21_I(inode));
+	ext21_range_unlock(inode, &range);
 
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
 	if (inode_needs_sync(inode)) {
@@ -1376,7 +2038,8 @@ struct inode *ext21_iget (struct super_block *sb, unsigned long ino)
 	 * the test is that same one that e2fsck uses
 	 * NeilBrown 1999oct15
 	 */
-	if (inode->i_nlink == 0 && (inode->i_mode == 0 || ei->i_dtime)) {
+	if (inode->i_nlink == 0 && (inode->i_mode == 0 || (ei->i_dtime &&
+	    !(EXT21_SB(sb)->s_mount_state & EXT21_ORPHAN_FS)))) {
 		/* this inode is deleted */
 		brelse (bh);
 		ret = -ESTALE;
@@ -1398,7 +2061,6 @@ struct inode *ext21_iget (struct super_block *sb, unsigned long ino)
 	ei->i_state = 0;
 	ei->i_block_group = (ino - 1) / EXT21_INODES_PER_GROUP(inode->i_sb);
 	ei->i_dir_start_lookup = 0;
-
 	/*
 	 * NOTE! The in-memory inode i_data array is in little-endian order
 	 * even on big-endian machines: we do NOT byteswap the block numbers!
@@ -1406,6 +2068,14 @@ struct inode *ext21_iget (struct super_block *sb, unsigned long ino)
 	for (n = 0; n < EXT21_N_BLOCKS; n++)
 		ei->i_data[n] = raw_inode->i_block[n];
 
+	if (ei->i_flags & EXT21_EXTENTS_FL) {
+		ret = ext21_ext_check_inode(inode);
+		if (ret) {
+			brelse (bh);
+			goto bad_inode;
+		}
+	}
+
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &ext21_file_inode_operations;
 		if (test_opt(inode->i_sb, NOBH)) {
@@ -1447,6 +2117,13 @@ struct inode *ext21_iget (struct super_block *sb, unsigned long ino)
 	}
 	brelse (bh);
 	ext21_set_inode_flags(inode);
+	if (S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)) {
+		ext21_load_placement(inode);
+		ext21_load_alloc_flags(inode);
+	} else {
+		memset(&ei->i_place, 0, sizeof(ei->i_place));
+		ei->i_alloc_flags = 0;
+	}
 	unlock_new_inode(inode);
 	return inode;
 	
@@ -1581,7 +2258,14 @@ int ext21_setattr(struct dentry *dentry, struct iattr *iattr)
 	}
 	if ((iattr->ia_valid & ATTR_UID && !uid_eq(iattr->ia_uid, inode->i_uid)) ||
 	    (iattr->ia_valid & ATTR_GID && !gid_eq(iattr->ia_gid, inode->i_gid))) {
+		/*
+		 * the credit was charged to the old owner; no allocation may
+		 * charge a new batch to it before the transfer
+		 */
+		mutex_lock(&EXT21_I(inode)->truncate_mutex);
+		ext21_settle_quota(inode);
 		error = dquot_transfer(inode, iattr);
+		mutex_unlock(&EXT21_I(inode)->truncate_mutex);
 		if (error)
 			return error;
 	}
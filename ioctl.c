@@ -8,19 +8,128 @@
  */
 
 #include "ext21.h"
+#include "xattr.h"
 #include <linux/capability.h>
 #include <linux/time.h>
 #include <linux/sched.h>
 #include <linux/compat.h>
 #include <linux/mount.h>
+#include <linux/quotaops.h>
 #include <asm/current.h>
 #include <asm/uaccess.h>
 
+/*
+ * Check a placement hint coming from userspace or from disk against the
+ * geometry of the filesystem.
+ */
+int ext21_valid_placement(struct super_block *sb,
+			  struct ext21_placement_hint *ph)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	switch (ph->ph_type) {
+	case EXT21_PLACE_NONE:
+		return !ph->ph_group && !ph->ph_ngroups && !ph->ph_ino;
+	case EXT21_PLACE_GROUPS:
+		return !ph->ph_ino && ph->ph_group < sbi->s_groups_count &&
+			ph->ph_ngroups &&
+			ph->ph_ngroups <= sbi->s_groups_count - ph->ph_group;
+	case EXT21_PLACE_INODE:
+		return !ph->ph_group && !ph->ph_ngroups && ph->ph_ino &&
+			ph->ph_ino <= le32_to_cpu(sbi->s_es->s_inodes_count);
+	}
+	return 0;
+}
+
+/* on-disk form of a placement hint, in the system.placement attribute */
+struct ext21_placement_attr {
+	__le32	pa_type;
+	__le32	pa_group;
+	__le32	pa_ngroups;
+	__le32	pa_ino;
+};
+
+/*
+ * Read the placement hint of a file or directory being brought in.  A
+ * hint is only advice: one that is missing, unreadable or does not fit
+ * the filesystem is no hint at all.
+ */
+void ext21_load_placement(struct inode *inode)
+{
+	struct ext21_placement_hint *ph = &EXT21_I(inode)->i_place;
+	struct ext21_placement_attr pa;
+	int ret;
+
+	memset(ph, 0, sizeof(*ph));
+	ret = ext21_xattr_get(inode, EXT21_XATTR_INDEX_SYSTEM,
+			      EXT21_XATTR_PLACEMENT, &pa, sizeof(pa));
+	if (ret != sizeof(pa))
+		return;
+	ph->ph_type = le32_to_cpu(pa.pa_type);
+	ph->ph_group = le32_to_cpu(pa.pa_group);
+	ph->ph_ngroups = le32_to_cpu(pa.pa_ngroups);
+	ph->ph_ino = le32_to_cpu(pa.pa_ino);
+	if (!ext21_valid_placement(inode->i_sb, ph))
+		memset(ph, 0, sizeof(*ph));
+}
+
+/*
+ * Store @ph as the placement hint of @inode, or remove the attribute for
+ * EXT21_PLACE_NONE.  The caller updates i_place once this succeeds.
+ */
+int ext21_save_placement(struct inode *inode, struct ext21_placement_hint *ph)
+{
+	struct ext21_placement_attr pa;
+
+	if (ph->ph_type == EXT21_PLACE_NONE)
+		return ext21_xattr_set(inode, EXT21_XATTR_INDEX_SYSTEM,
+				       EXT21_XATTR_PLACEMENT, NULL, 0, 0);
+
+	pa.pa_type = cpu_to_le32(ph->ph_type);
+	pa.pa_group = cpu_to_le32(ph->ph_group);
+	pa.pa_ngroups = cpu_to_le32(ph->ph_ngroups);
+	pa.pa_ino = cpu_to_le32(ph->ph_ino);
+	return ext21_xattr_set(inode, EXT21_XATTR_INDEX_SYSTEM,
+			       EXT21_XATTR_PLACEMENT, &pa, sizeof(pa), 0);
+}
+
+/*
+ * Read the allocation flags of a file or directory being brought in,
+ * keeping only those this kernel knows.
+ */
+void ext21_load_alloc_flags(struct inode *inode)
+{
+	__le32 flags;
+
+	EXT21_I(inode)->i_alloc_flags = 0;
+	if (ext21_xattr_get(inode, EXT21_XATTR_INDEX_SYSTEM,
+			    EXT21_XATTR_ALLOC_FLAGS, &flags,
+			    sizeof(flags)) == sizeof(flags))
+		EXT21_I(inode)->i_alloc_flags = le32_to_cpu(flags) &
+						EXT21_ALLOC_FLAGS;
+}
+
+/*
+ * Store @flags as the allocation flags of @inode, or remove the attribute
+ * when there are none.  The caller updates i_alloc_flags once this
+ * succeeds.
+ */
+int ext21_save_alloc_flags(struct inode *inode, __u32 flags)
+{
+	__le32 value = cpu_to_le32(flags);
+
+	if (!flags)
+		return ext21_xattr_set(inode, EXT21_XATTR_INDEX_SYSTEM,
+				       EXT21_XATTR_ALLOC_FLAGS, NULL, 0, 0);
+	return ext21_xattr_set(inode, EXT21_XATTR_INDEX_SYSTEM,
+			       EXT21_XATTR_ALLOC_FLAGS, &value, sizeof(value), 0);
+}
 
 long ext21_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct inode *inode = file_inode(filp);
 	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_placement_hint ph;
 	unsigned int flags;
 	unsigned short rsv_window_size;
 	int ret;
@@ -116,7 +225,7 @@ setversion_out:
 		if (test_opt(inode->i_sb, RESERVATION)
 			&& S_ISREG(inode->i_mode)
 			&& ei->i_block_alloc_info) {
-			rsv_window_size = ei->i_block_alloc_info->rsv_window_node.rsv_goal_size;
+			rsv_window_size = ei->i_block_alloc_info->streams[0].rsv_window_node.rsv_goal_size;
 			return put_user(rsv_window_size, (int __user *)arg);
 		}
 		return -ENOTTY;
@@ -151,13 +260,79 @@ setversion_out:
 			ext21_init_block_alloc_info(inode);
 
 		if (ei->i_block_alloc_info){
-			struct ext21_reserve_window_node *rsv = &ei->i_block_alloc_info->rsv_window_node;
-			rsv->rsv_goal_size = rsv_window_size;
+			struct ext21_alloc_stream *streams = ei->i_block_alloc_info->streams;
+			int i;
+
+			/* the size applies to every allocation stream */
+			for (i = 0; i < EXT21_ALLOC_STREAMS; i++)
+				streams[i].rsv_window_node.rsv_goal_size = rsv_window_size;
 		}
 		mutex_unlock(&ei->truncate_mutex);
 		mnt_drop_write_file(filp);
 		return 0;
 	}
+	case EXT21_IOC_GETPLACEMENT:
+		inode_lock(inode);
+		ph = ei->i_place;
+		inode_unlock(inode);
+		if (copy_to_user((void __user *)arg, &ph, sizeof(ph)))
+			return -EFAULT;
+		return 0;
+	case EXT21_IOC_SETPLACEMENT:
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+
+		if (copy_from_user(&ph, (void __user *)arg, sizeof(ph)))
+			return -EFAULT;
+
+		if (!ext21_valid_placement(inode->i_sb, &ph))
+			return -EINVAL;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+
+		/* the attribute block is charged to the owner */
+		ret = dquot_initialize(inode);
+		if (ret)
+			goto setplacement_out;
+
+		inode_lock(inode);
+		ret = ext21_save_placement(inode, &ph);
+		if (!ret)
+			ei->i_place = ph;
+		inode_unlock(inode);
+setplacement_out:
+		mnt_drop_write_file(filp);
+		return ret;
+	case EXT21_IOC_GETALLOCFLAGS:
+		return put_user(ei->i_alloc_flags, (int __user *) arg);
+	case EXT21_IOC_SETALLOCFLAGS:
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+
+		if (get_user(flags, (int __user *) arg))
+			return -EFAULT;
+
+		if (flags & ~EXT21_ALLOC_FLAGS)
+			return -EINVAL;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+
+		ret = dquot_initialize(inode);
+		if (ret)
+			goto setallocflags_out;
+
+		inode_lock(inode);
+		ret = ext21_save_alloc_flags(inode, flags);
+		if (!ret)
+			ei->i_alloc_flags = flags;
+		inode_unlock(inode);
+setallocflags_out:
+		mnt_drop_write_file(filp);
+		return ret;
 	default:
 		return -ENOTTY;
 	}
@@ -180,6 +355,11 @@ long ext21_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case EXT21_IOC32_SETVERSION:
 		cmd = EXT21_IOC_SETVERSION;
 		break;
+	case EXT21_IOC_GETPLACEMENT:
+	case EXT21_IOC_SETPLACEMENT:
+	case EXT21_IOC_GETALLOCFLAGS:
+	case EXT21_IOC_SETALLOCFLAGS:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
@@ -0,0 +1,386 @@
+/*
+ * linux/fs/ext21/mapcache.c
+ *
+ * Cache of the block mappings of an inode
+ *
+ * ext21_get_blocks() walks the indirect chain, or the extent tree, for
+ * every call, even for blocks it mapped a moment ago.  The runs of blocks
+ * it returns are kept here, in a per-inode rbtree sorted by logical block,
+ * so that page faults, direct I/O and reads of mapped ranges find them
+ * without touching the tree or its buffers.
+ *
+ * Only mapped blocks are cached, never holes, and blocks only stop being
+ * mapped by truncate.  Truncate drops the cached runs it cuts, under
+ * truncate_mutex, before and after freeing the blocks.  Every invalidation
+ * bumps i_map_seq: a lookup done without truncate_mutex is only cached if
+ * no invalidation happened since it started, so blocks freed meanwhile
+ * never get in.  The shrinker drops whole inodes' caches under memory
+ * pressure.
+ *
+ * Lookups take no lock: they walk the tree under rcu_read_lock() and start
+ * over if i_map_lock changed meanwhile, so that parallel readers of a file
+ * do not bounce a lock between CPUs.  Changes are made under the write side
+ * of i_map_lock, and runs are freed after a grace period.
+ */
+
+#include "ext21.h"
+#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+
+/* past this many runs the cache of an inode starts over */
+#define EXT21_MAP_MAX_EXTENTS	256
+
+struct ext21_map_extent {
+	struct rb_node	me_node;
+	__u32		me_lblk;	/* first logical block */
+	__u32		me_len;		/* number of blocks */
+	ext21_fsblk_t	me_pblk;	/* first physical block */
+	struct rcu_head	me_rcu;
+};
+
+static struct kmem_cache *ext21_map_cachep;
+
+static inline struct ext21_map_extent *ext21_map_entry(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct ext21_map_extent, me_node) : NULL;
+}
+
+/* last run starting at or before @lblk, NULL if there is none */
+static struct ext21_map_extent *ext21_map_search(struct ext21_inode_info *ei,
+						 __u32 lblk)
+{
+	struct rb_node *n = ei->i_map_tree.rb_node;
+	struct ext21_map_extent *me, *prev = NULL;
+
+	while (n) {
+		me = ext21_map_entry(n);
+		if (lblk < me->me_lblk) {
+			n = n->rb_left;
+		} else {
+			prev = me;
+			n = n->rb_right;
+		}
+	}
+	return prev;
+}
+
+/*
+ * The same as ext21_map_search(), for lookups that do not hold i_map_lock.
+ * Rebalancing may hide runs from it, never send it round in circles; the
+ * caller retries if the tree changed.
+ */
+static struct ext21_map_extent *
+ext21_map_search_rcu(struct ext21_inode_info *ei, __u32 lblk)
+{
+	struct rb_node *n = rcu_dereference_raw(ei->i_map_tree.rb_node);
+	struct ext21_map_extent *me, *prev = NULL;
+
+	while (n) {
+		me = ext21_map_entry(n);
+		if (lblk < READ_ONCE(me->me_lblk)) {
+			n = rcu_dereference_raw(n->rb_left);
+		} else {
+			prev = me;
+			n = rcu_dereference_raw(n->rb_right);
+		}
+	}
+	return prev;
+}
+
+static void ext21_map_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(ext21_map_cachep,
+			container_of(head, struct ext21_map_extent, me_rcu));
+}
+
+static void ext21_map_erase(struct ext21_inode_info *ei,
+			    struct ext21_map_extent *me)
+{
+	rb_erase(&me->me_node, &ei->i_map_tree);
+	/* lockless lookups may still be looking at it */
+	call_rcu(&me->me_rcu, ext21_map_free_rcu);
+	ei->i_map_count--;
+}
+
+/* drop the runs from @node on; returns how many there were */
+static unsigned int ext21_map_erase_from(struct ext21_inode_info *ei,
+					 struct rb_node *node)
+{
+	struct rb_node *next;
+	unsigned int n = 0;
+
+	while (node) {
+		next = rb_next(node);
+		ext21_map_erase(ei, ext21_map_entry(node));
+		n++;
+		node = next;
+	}
+	return n;
+}
+
+/**
+ * ext21_map_lookup()
+ * @inode:		inode
+ * @iblock:		first logical block
+ * @maxblocks:		number of blocks wanted
+ * @pblk:		first physical block, if mapped
+ * @seq:		cookie for a later ext21_map_insert()
+ *
+ * Returns the number of cached mapped blocks from @iblock on, at most
+ * @maxblocks, or 0 if @iblock is not in the cache.
+ */
+int ext21_map_lookup(struct inode *inode, sector_t iblock,
+		     unsigned long maxblocks, ext21_fsblk_t *pblk,
+		     unsigned int *seq)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_map_extent *me;
+	unsigned long end;
+	unsigned int start;
+	int count;
+
+	rcu_read_lock();
+	do {
+		start = read_seqbegin(&ei->i_map_lock);
+		count = 0;
+		*seq = ei->i_map_seq;
+		if (iblock > U32_MAX || !READ_ONCE(ei->i_map_count))
+			continue;
+		me = ext21_map_search_rcu(ei, iblock);
+		if (!me)
+			continue;
+		end = (unsigned long)me->me_lblk + me->me_len;
+		if (iblock < end) {
+			*pblk = me->me_pblk + (iblock - me->me_lblk);
+			count = min(maxblocks, (unsigned long)(end - iblock));
+		}
+	} while (read_seqretry(&ei->i_map_lock, start));
+	rcu_read_unlock();
+	return count;
+}
+
+/**
+ * ext21_map_insert()
+ * @inode:		inode
+ * @iblock:		first logical block
+ * @pblk:		first physical block
+ * @len:		number of blocks
+ * @seq:		cookie from the ext21_map_lookup() before the mapping
+ *
+ * Cache a run of mapped blocks found or allocated by ext21_get_blocks(),
+ * merging it with the runs it continues.  Nothing is cached if the cache
+ * was invalidated since @seq was taken.
+ */
+void ext21_map_insert(struct inode *inode, sector_t iblock,
+		      ext21_fsblk_t pblk, unsigned long len, unsigned int seq)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+	struct ext21_map_extent *me, *left, *right, *new;
+	struct rb_node **p, *parent = NULL;
+	__u32 lblk = iblock;
+	long delta = 0;
+	bool listed;
+
+	if (!len || iblock + len - 1 > U32_MAX)
+		return;
+
+	new = kmem_cache_alloc(ext21_map_cachep, GFP_NOFS);
+	if (!new)
+		return;
+
+	write_seqlock(&ei->i_map_lock);
+	if (ei->i_map_seq != seq)
+		goto out_free;
+	if (ei->i_map_count >= EXT21_MAP_MAX_EXTENTS)
+		delta -= ext21_map_erase_from(ei, rb_first(&ei->i_map_tree));
+
+	/* runs in the way describe the same blocks, or are stale */
+	left = ext21_map_search(ei, lblk + len - 1);
+	while (left && (unsigned long)left->me_lblk + left->me_len > lblk) {
+		me = left;
+		left = ext21_map_entry(rb_prev(&me->me_node));
+		ext21_map_erase(ei, me);
+		delta--;
+	}
+	right = left ? ext21_map_entry(rb_next(&left->me_node)) :
+		       ext21_map_entry(rb_first(&ei->i_map_tree));
+
+	if (left && left->me_lblk + left->me_len == lblk &&
+	    left->me_pblk + left->me_len == pblk &&
+	    (unsigned long)left->me_len + len <= U32_MAX) {
+		left->me_len += len;
+		/* filled the gap up to the next run? */
+		if (right && left->me_lblk + left->me_len == right->me_lblk &&
+		    left->me_pblk + left->me_len == right->me_pblk &&
+		    (unsigned long)left->me_len + right->me_len <= U32_MAX) {
+			left->me_len += right->me_len;
+			ext21_map_erase(ei, right);
+			delta--;
+		}
+		goto out_free;
+	}
+	if (right && lblk + len == right->me_lblk &&
+	    pblk + len == right->me_pblk &&
+	    (unsigned long)right->me_len + len <= U32_MAX) {
+		right->me_lblk = lblk;
+		right->me_pblk = pblk;
+		right->me_len += len;
+		goto out_free;
+	}
+
+	new->me_lblk = lblk;
+	new->me_len = len;
+	new->me_pblk = pblk;
+	p = &ei->i_map_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		if (lblk < ext21_map_entry(parent)->me_lblk)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node_rcu(&new->me_node, parent, p);
+	rb_insert_color(&new->me_node, &ei->i_map_tree);
+	ei->i_map_count++;
+	delta++;
+	/* nobody takes the inode off the list while we hold i_map_lock */
+	listed = !list_empty(&ei->i_map_list);
+	write_sequnlock(&ei->i_map_lock);
+
+	atomic_long_add(delta, &sbi->s_map_count);
+	if (!listed) {
+		spin_lock(&sbi->s_map_lock);
+		if (list_empty(&ei->i_map_list))
+			list_add_tail(&ei->i_map_list, &sbi->s_map_list);
+		spin_unlock(&sbi->s_map_lock);
+	}
+	return;
+
+out_free:
+	write_sequnlock(&ei->i_map_lock);
+	kmem_cache_free(ext21_map_cachep, new);
+	atomic_long_add(delta, &sbi->s_map_count);
+}
+
+/**
+ * ext21_map_invalidate()
+ * @inode:		inode
+ * @from:		first logical block no longer mapped
+ *
+ * Drop the cached mappings from @from on; called by truncate with
+ * truncate_mutex held, and with @from == 0 when the inode goes away.
+ */
+void ext21_map_invalidate(struct inode *inode, sector_t from)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+	struct ext21_map_extent *me;
+	struct rb_node *node;
+	unsigned int n;
+
+	/*
+	 * s_map_lock first, as in the shrinker: it also waits for a shrinker
+	 * still dropping the runs of the inode before eviction goes on
+	 */
+	spin_lock(&sbi->s_map_lock);
+	write_seqlock(&ei->i_map_lock);
+	ei->i_map_seq++;
+	node = rb_first(&ei->i_map_tree);
+	if (from <= U32_MAX) {
+		me = ext21_map_search(ei, from);
+		if (me) {
+			node = rb_next(&me->me_node);
+			if (me->me_lblk >= from)
+				node = &me->me_node;
+			else if ((unsigned long)me->me_lblk + me->me_len > from)
+				me->me_len = from - me->me_lblk;
+		}
+	} else {
+		node = NULL;
+	}
+	n = ext21_map_erase_from(ei, node);
+	if (!ei->i_map_count)
+		list_del_init(&ei->i_map_list);
+	write_sequnlock(&ei->i_map_lock);
+	spin_unlock(&sbi->s_map_lock);
+
+	if (n)
+		atomic_long_sub(n, &sbi->s_map_count);
+}
+
+static unsigned long ext21_map_count(struct shrinker *shrink,
+				     struct shrink_control *sc)
+{
+	struct ext21_sb_info *sbi = container_of(shrink, struct ext21_sb_info,
+						 s_map_shrinker);
+
+	return atomic_long_read(&sbi->s_map_count);
+}
+
+static unsigned long ext21_map_scan(struct shrinker *shrink,
+				    struct shrink_control *sc)
+{
+	struct ext21_sb_info *sbi = container_of(shrink, struct ext21_sb_info,
+						 s_map_shrinker);
+	struct ext21_inode_info *ei;
+	unsigned long freed = 0;
+	unsigned int n;
+
+	while (freed < sc->nr_to_scan) {
+		spin_lock(&sbi->s_map_lock);
+		if (list_empty(&sbi->s_map_list)) {
+			spin_unlock(&sbi->s_map_lock);
+			break;
+		}
+		ei = list_first_entry(&sbi->s_map_list,
+				      struct ext21_inode_info, i_map_list);
+		/* a mapping is never stale because of this, no i_map_seq bump */
+		write_seqlock(&ei->i_map_lock);
+		list_del_init(&ei->i_map_list);
+		n = ext21_map_erase_from(ei, rb_first(&ei->i_map_tree));
+		write_sequnlock(&ei->i_map_lock);
+		spin_unlock(&sbi->s_map_lock);
+
+		atomic_long_sub(n, &sbi->s_map_count);
+		freed += n;
+	}
+	return freed;
+}
+
+/**
+ * ext21_register_map_shrinker()
+ * @sb:			super block
+ *
+ * Set up the list of inodes with cached mappings and register its shrinker.
+ */
+int ext21_register_map_shrinker(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	spin_lock_init(&sbi->s_map_lock);
+	INIT_LIST_HEAD(&sbi->s_map_list);
+	atomic_long_set(&sbi->s_map_count, 0);
+	sbi->s_map_shrinker.count_objects = ext21_map_count;
+	sbi->s_map_shrinker.scan_objects = ext21_map_scan;
+	sbi->s_map_shrinker.seeks = DEFAULT_SEEKS;
+	return register_shrinker(&sbi->s_map_shrinker);
+}
+
+int __init ext21_init_map_cache(void)
+{
+	ext21_map_cachep = kmem_cache_create("ext21_map_extent",
+					     sizeof(struct ext21_map_extent),
+					     0, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (ext21_map_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void ext21_destroy_map_cache(void)
+{
+	/* runs of evicted inodes may still be waiting for a grace period */
+	rcu_barrier();
+	kmem_cache_destroy(ext21_map_cachep);
+}
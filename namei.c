@@ -306,6 +306,7 @@ static int ext21_unlink(struct inode * dir, struct dentry *dentry)
 
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
+	ext21_orphan_add(inode);
 	err = 0;
 out:
 	return err;
@@ -376,6 +377,7 @@ static int ext21_rename (struct inode * old_dir, struct dentry * old_dentry,
 		if (dir_de)
 			drop_nlink(new_inode);
 		inode_dec_link_count(new_inode);
+		ext21_orphan_add(new_inode);
 	} else {
 		err = ext21_add_link(new_dentry, old_inode);
 		if (err)
@@ -0,0 +1,352 @@
+/*
+ * linux/fs/ext21/orphan.c
+ *
+ * Deferred deletion of large files (defer_delete)
+ *
+ * Freeing the blocks of a deleted file used to happen in the last iput(),
+ * holding up whoever dropped the last reference for as long as it takes
+ * to free hundreds of gigabytes.  Instead, a large regular file whose
+ * last link goes away is put on the orphan list: on disk, s_last_orphan
+ * in the superblock points to the first orphan inode and i_dtime of each
+ * orphan to the next, as with ext3, and s_orphan_list mirrors that chain
+ * in memory.  The list holds a reference to the inode, so that neither
+ * the last close nor inode reclaim deletes it; once nobody else uses it,
+ * s_orphan_work frees its blocks from the end, a chunk at a time, and
+ * drops that reference, and eviction deletes the now small inode and
+ * takes it off the list.
+ *
+ * After a crash, the chain is read back at mount time and the worker
+ * takes over where it stopped.  s_orphan_lock protects the list, the
+ * i_dtime links and s_last_orphan.
+ */
+
+#include "ext21.h"
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/quotaops.h>
+
+static bool ext21_delete_is_large(struct inode *inode)
+{
+	return S_ISREG(inode->i_mode) && !IS_APPEND(inode) &&
+		!IS_IMMUTABLE(inode) &&
+		(inode->i_blocks >> (inode->i_blkbits - 9)) >=
+						EXT21_DEFER_DELETE_BLOCKS;
+}
+
+static void ext21_set_last_orphan(struct ext21_sb_info *sbi, __u32 ino)
+{
+	spin_lock(&sbi->s_lock);
+	sbi->s_es->s_last_orphan = cpu_to_le32(ino);
+	spin_unlock(&sbi->s_lock);
+	mark_buffer_dirty(sbi->s_sbh);
+}
+
+/**
+ * ext21_orphan_add()
+ * @inode:		inode that just lost a link
+ *
+ * Put a large file whose last link is gone on the orphan list, so that
+ * its blocks are freed in the background once it is closed.
+ */
+void ext21_orphan_add(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	struct ext21_inode_info *ei = EXT21_I(inode);
+
+	if (inode->i_nlink || !test_opt(sb, DEFER_DELETE) ||
+	    !ext21_delete_is_large(inode))
+		return;
+
+	mutex_lock(&sbi->s_orphan_lock);
+	if (list_empty(&ei->i_orphan)) {
+		ei->i_dtime = le32_to_cpu(sbi->s_es->s_last_orphan);
+		list_add(&ei->i_orphan, &sbi->s_orphan_list);
+		ihold(inode);
+		ei->i_orphan_pinned = true;
+		mark_inode_dirty(inode);
+		ext21_set_last_orphan(sbi, inode->i_ino);
+	}
+	mutex_unlock(&sbi->s_orphan_lock);
+	/* the caller's dentry still holds it for a moment */
+	queue_delayed_work(system_long_wq, &sbi->s_orphan_work, HZ / 10);
+}
+
+/**
+ * ext21_orphan_del()
+ * @inode:		inode being deleted
+ *
+ * Unlink the inode from the orphan chain, before eviction reuses its
+ * i_dtime.
+ */
+void ext21_orphan_del(struct inode *inode)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	struct ext21_inode_info *prev;
+
+	/* only unlink adds inodes, and it is done with this one */
+	if (list_empty(&ei->i_orphan))
+		return;
+
+	mutex_lock(&sbi->s_orphan_lock);
+	if (ei->i_orphan.prev == &sbi->s_orphan_list) {
+		ext21_set_last_orphan(sbi, ei->i_dtime);
+	} else {
+		prev = list_entry(ei->i_orphan.prev, struct ext21_inode_info,
+				  i_orphan);
+		prev->i_dtime = ei->i_dtime;
+		mark_inode_dirty(&prev->vfs_inode);
+	}
+	list_del_init(&ei->i_orphan);
+	ei->i_dtime = 0;
+	mutex_unlock(&sbi->s_orphan_lock);
+}
+
+/**
+ * ext21_orphan_release()
+ * @inode:		inode of a file being closed
+ *
+ * Let the worker have a look at a deleted file once it is closed.
+ */
+void ext21_orphan_release(struct inode *inode)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(inode->i_sb);
+
+	if (!inode->i_nlink && !list_empty(&EXT21_I(inode)->i_orphan))
+		mod_delayed_work(system_long_wq, &sbi->s_orphan_work, HZ / 10);
+}
+
+/* no freeing on a read-only file system, nor on the way to one */
+static bool ext21_orphan_stopped(struct super_block *sb)
+{
+	return (sb->s_flags & MS_RDONLY) || EXT21_SB(sb)->s_orphan_stopped;
+}
+
+/*
+ * Take over the reference the list holds to the next orphan nobody else
+ * uses; *@busy tells if any were still in use.
+ */
+static struct inode *ext21_next_orphan(struct ext21_sb_info *sbi, bool *busy)
+{
+	struct ext21_inode_info *ei;
+	struct inode *inode = NULL;
+
+	if (ext21_orphan_stopped(sbi->s_sb))
+		return NULL;
+
+	mutex_lock(&sbi->s_orphan_lock);
+	list_for_each_entry(ei, &sbi->s_orphan_list, i_orphan) {
+		if (!ei->i_orphan_pinned)
+			continue;
+		if (atomic_read(&ei->vfs_inode.i_count) > 1) {
+			*busy = true;
+			continue;
+		}
+		ei->i_orphan_pinned = false;
+		inode = &ei->vfs_inode;
+		break;
+	}
+	mutex_unlock(&sbi->s_orphan_lock);
+	return inode;
+}
+
+/*
+ * Free the blocks of an orphan from the end, EXT21_DEFER_DELETE_CHUNK
+ * blocks of offset at a time, until it is small enough for eviction.
+ * Stops, returning false, if somebody else gets hold of the inode
+ * meanwhile or the file system goes read-only.
+ */
+static bool ext21_free_orphan(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	loff_t chunk = (loff_t)EXT21_DEFER_DELETE_CHUNK << inode->i_blkbits;
+	loff_t size;
+
+	/* the blocks go off the owner's quota, as in eviction */
+	dquot_initialize(inode);
+	while (ext21_delete_is_large(inode)) {
+		if (atomic_read(&inode->i_count) > 1 ||
+		    ext21_orphan_stopped(sb))
+			return false;
+
+		sb_start_intwrite(sb);
+		inode_lock(inode);
+		size = inode->i_size > chunk ? inode->i_size - chunk : 0;
+		truncate_setsize(inode, size);
+		ext21_truncate_blocks(inode, size);
+		mark_inode_dirty(inode);
+		inode_unlock(inode);
+		sb_end_intwrite(sb);
+
+		if (!size)
+			break;
+		cond_resched();
+	}
+	return true;
+}
+
+/**
+ * ext21_orphan_work()
+ * @work:		s_orphan_work
+ *
+ * Free the orphans nobody uses; the final iput() deletes each of them.
+ * Those still in use are looked at again later, in case no close tells.
+ */
+void ext21_orphan_work(struct work_struct *work)
+{
+	struct ext21_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext21_sb_info, s_orphan_work);
+	struct inode *inode;
+	bool busy = false;
+
+	while ((inode = ext21_next_orphan(sbi, &busy)) != NULL) {
+		if (ext21_free_orphan(inode)) {
+			iput(inode);
+		} else {
+			/* the list keeps holding it */
+			mutex_lock(&sbi->s_orphan_lock);
+			EXT21_I(inode)->i_orphan_pinned = true;
+			mutex_unlock(&sbi->s_orphan_lock);
+			busy = true;
+		}
+		cond_resched();
+	}
+	if (busy && !ext21_orphan_stopped(sbi->s_sb))
+		queue_delayed_work(system_long_wq, &sbi->s_orphan_work,
+				   EXT21_DEFER_DELETE_RETRY);
+}
+
+/**
+ * ext21_orphan_cleanup()
+ * @sb:			super block, mounted read-write
+ *
+ * Read back the orphan chain left by a crash, or by a read-only mount,
+ * and hand it to the worker; restart the worker on the orphans a
+ * read-only remount stopped it on.  A broken chain is cut at the last
+ * inode that makes sense; e2fsck deals with the rest.
+ */
+void ext21_orphan_cleanup(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	struct ext21_inode_info *ei, *last = NULL;
+	unsigned long ino = le32_to_cpu(sbi->s_es->s_last_orphan);
+	unsigned long max = le32_to_cpu(sbi->s_es->s_inodes_count);
+	struct inode *inode;
+	const char *bad = NULL;
+	int nr = 0;
+
+	mutex_lock(&sbi->s_orphan_lock);
+	sbi->s_orphan_stopped = false;
+	/* the list mirrors the chain already */
+	if (!ino || !list_empty(&sbi->s_orphan_list))
+		goto out;
+
+	sbi->s_mount_state |= EXT21_ORPHAN_FS;
+	while (ino) {
+		if (ino < EXT21_FIRST_INO(sb) || ino > max || nr >= max) {
+			bad = "bad inode number";
+			break;
+		}
+		/* an inode freed already must not be freed again */
+		if (ext21_inode_in_use(sb, ino) != 1) {
+			bad = "inode not allocated";
+			break;
+		}
+		inode = ext21_iget(sb, ino);
+		if (IS_ERR(inode)) {
+			bad = "cannot read inode";
+			break;
+		}
+		ei = EXT21_I(inode);
+		if (inode->i_nlink || !list_empty(&ei->i_orphan)) {
+			bad = inode->i_nlink ? "inode in use" : "loop";
+			iput(inode);
+			break;
+		}
+		/* in a deleted inode, i_dtime is a time, not a link */
+		if (ei->i_dtime && (ei->i_dtime < EXT21_FIRST_INO(sb) ||
+				    ei->i_dtime > max)) {
+			bad = "not on the list";
+			/* leave whatever it is to e2fsck, do not delete it */
+			make_bad_inode(inode);
+			iput(inode);
+			break;
+		}
+		ino = ei->i_dtime;
+		ei->i_orphan_pinned = true;
+		list_add_tail(&ei->i_orphan, &sbi->s_orphan_list);
+		last = ei;
+		nr++;
+	}
+	sbi->s_mount_state &= ~EXT21_ORPHAN_FS;
+
+	if (bad) {
+		ext21_msg(sb, KERN_WARNING,
+			  "warning: orphan list broken at inode %lu (%s), "
+			  "run e2fsck", ino, bad);
+		if (last) {
+			last->i_dtime = 0;
+			mark_inode_dirty(&last->vfs_inode);
+		} else {
+			ext21_set_last_orphan(sbi, 0);
+		}
+	}
+	if (nr)
+		ext21_msg(sb, KERN_INFO, "freeing %d deleted files in the "
+			  "background", nr);
+out:
+	/* whatever is left from before a read-only remount, too */
+	if (!list_empty(&sbi->s_orphan_list))
+		queue_delayed_work(system_long_wq, &sbi->s_orphan_work, 0);
+	mutex_unlock(&sbi->s_orphan_lock);
+}
+
+/**
+ * ext21_orphan_stop()
+ * @sb:			super block being remounted read-only
+ *
+ * Wait for the worker and keep it from freeing anything until
+ * ext21_orphan_cleanup() restarts it: the remount marks the file system
+ * valid and suspends quota before MS_RDONLY is set.
+ */
+void ext21_orphan_stop(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	mutex_lock(&sbi->s_orphan_lock);
+	sbi->s_orphan_stopped = true;
+	mutex_unlock(&sbi->s_orphan_lock);
+	cancel_delayed_work_sync(&sbi->s_orphan_work);
+}
+
+/**
+ * ext21_orphan_shutdown()
+ * @sb:			super block going away
+ *
+ * Called from put_super, once MS_ACTIVE is gone: wait for the worker, and
+ * drop the references the list still holds, which deletes those orphans.
+ */
+void ext21_orphan_shutdown(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	struct ext21_inode_info *ei;
+	struct inode *inode;
+
+	cancel_delayed_work_sync(&sbi->s_orphan_work);
+	for (;;) {
+		inode = NULL;
+		mutex_lock(&sbi->s_orphan_lock);
+		list_for_each_entry(ei, &sbi->s_orphan_list, i_orphan) {
+			if (ei->i_orphan_pinned) {
+				ei->i_orphan_pinned = false;
+				inode = &ei->vfs_inode;
+				break;
+			}
+		}
+		mutex_unlock(&sbi->s_orphan_lock);
+		if (!inode)
+			break;
+		iput(inode);
+	}
+}
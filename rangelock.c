@@ -0,0 +1,89 @@
+/*
+ * linux/fs/ext21/rangelock.c
+ *
+ * Byte range locks of regular files
+ *
+ * i_mutex serialises every write to a file, however far apart.  Writes
+ * that stay within i_size, and so change nothing but the pages and blocks
+ * they cover, take a lock on their range of bytes instead and drop i_mutex
+ * while copying or doing the direct I/O (see ext21_file_write_iter());
+ * writers of other ranges go on meanwhile.  Writes that need i_mutex lock
+ * their range all the same, and truncate locks everything from the new
+ * size on, so that it never frees blocks under a writer.
+ *
+ * The ranges sit on i_ranges in the order they were asked for, and a
+ * range is granted once no overlapping range is ahead of it: overlapping
+ * lockers are served in order, and a truncate waiting for the end of the
+ * file is not overtaken by the writers coming after it.  i_range_lock
+ * protects the list.
+ */
+
+#include "ext21.h"
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+/* does a range ahead of @r overlap it? */
+static bool ext21_range_blocked(struct ext21_inode_info *ei,
+				struct ext21_range *r)
+{
+	struct ext21_range *p;
+
+	list_for_each_entry(p, &ei->i_ranges, r_list) {
+		if (p == r)
+			break;
+		if (p->r_start <= r->r_end && r->r_start <= p->r_end)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * ext21_range_lock()
+ * @inode:		regular file
+ * @r:			range to lock, usually on the caller's stack
+ * @start:		first byte
+ * @end:		last byte, LLONG_MAX for the end of the file
+ *
+ * Wait until no range locked or asked for before overlaps [@start, @end],
+ * and lock it.  Called with or without i_mutex; whoever holds a range
+ * must not wait for i_mutex.
+ */
+void ext21_range_lock(struct inode *inode, struct ext21_range *r,
+		      loff_t start, loff_t end)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	DEFINE_WAIT(wait);
+
+	r->r_start = start;
+	r->r_end = end;
+	spin_lock(&ei->i_range_lock);
+	list_add_tail(&r->r_list, &ei->i_ranges);
+	while (ext21_range_blocked(ei, r)) {
+		/* on the queue before ext21_range_unlock() can look at it */
+		prepare_to_wait(&ei->i_range_wait, &wait, TASK_UNINTERRUPTIBLE);
+		spin_unlock(&ei->i_range_lock);
+		schedule();
+		spin_lock(&ei->i_range_lock);
+	}
+	spin_unlock(&ei->i_range_lock);
+	finish_wait(&ei->i_range_wait, &wait);
+}
+
+/**
+ * ext21_range_unlock()
+ * @inode:		regular file
+ * @r:			range locked by ext21_range_lock()
+ */
+void ext21_range_unlock(struct inode *inode, struct ext21_range *r)
+{
+	struct ext21_inode_info *ei = EXT21_I(inode);
+	bool waiters;
+
+	spin_lock(&ei->i_range_lock);
+	list_del(&r->r_list);
+	waiters = waitqueue_active(&ei->i_range_wait);
+	spin_unlock(&ei->i_range_lock);
+
+	if (waiters)
+		wake_up_all(&ei->i_range_wait);
+}
@@ -129,6 +129,8 @@ static void ext21_put_super (struct super_block * sb)
 	int i;
 	struct ext21_sb_info *sbi = EXT21_SB(sb);
 
+	/* deletes what is left, so before quota goes */
+	ext21_orphan_shutdown(sb);
 	dquot_disable(sb, -1, DQUOT_USAGE_ENABLED | DQUOT_LIMITS_ENABLED);
 
 	ext21_xattr_put_super(sb);
@@ -146,6 +148,7 @@ static void ext21_put_super (struct super_block * sb)
 			brelse (sbi->s_group_desc[i]);
 	kfree(sbi->s_group_desc);
 	kfree(sbi->s_debts);
+	kfree(sbi->s_group_free_blocks);
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
@@ -164,6 +167,18 @@ static struct inode *ext21_alloc_inode(struct super_block *sb)
 	if (!ei)
 		return NULL;
 	ei->i_block_alloc_info = NULL;
+	ei->i_pack_goal = 0;
+	ei->i_prop_base = 0;
+	INIT_LIST_HEAD(&ei->i_retained);
+	INIT_LIST_HEAD(&ei->i_orphan);
+	ei->i_orphan_pinned = false;
+	INIT_LIST_HEAD(&ei->i_recycle);
+	ei->i_recycle_extents = 0;
+	ei->i_recycling = false;
+	ei->i_quota_credit = 0;
+	ei->i_map_tree = RB_ROOT;
+	ei->i_map_count = 0;
+	INIT_LIST_HEAD(&ei->i_map_list);
 	ei->vfs_inode.i_version = 1;
 #ifdef CONFIG_QUOTA
 	memset(&ei->i_dquot, 0, sizeof(ei->i_dquot));
@@ -192,6 +207,11 @@ static void init_once(void *foo)
 	init_rwsem(&ei->xattr_sem);
 #endif
 	mutex_init(&ei->truncate_mutex);
+	init_rwsem(&ei->i_data_sem);
+	seqlock_init(&ei->i_map_lock);
+	spin_lock_init(&ei->i_range_lock);
+	INIT_LIST_HEAD(&ei->i_ranges);
+	init_waitqueue_head(&ei->i_range_wait);
 #ifdef CONFIG_FS_DAX
 	init_rwsem(&ei->dax_sem);
 #endif
@@ -303,6 +323,22 @@ static int ext21_show_options(struct seq_file *seq, struct dentry *root)
 
 	if (!test_opt(sb, RESERVATION))
 		seq_puts(seq, ",noreservation");
+	if (test_opt(sb, KEEPRSV))
+		seq_puts(seq, ",keeprsv");
+	if (test_opt(sb, PREFETCH_BITMAPS))
+		seq_puts(seq, ",prefetch_bitmaps");
+	if (test_opt(sb, REUSE_TRUNCATED))
+		seq_puts(seq, ",reuse_truncated");
+	if (test_opt(sb, DEFER_DELETE))
+		seq_puts(seq, ",defer_delete");
+	if (sbi->s_smallfile_blocks)
+		seq_printf(seq, ",smallfile=%lu", sbi->s_smallfile_blocks);
+	if (sbi->s_dir_prealloc)
+		seq_printf(seq, ",dir_prealloc=%lu", sbi->s_dir_prealloc);
+	if (sbi->s_stripe)
+		seq_printf(seq, ",stripe=%lu", sbi->s_stripe);
+	if (sbi->s_stride)
+		seq_printf(seq, ",stride=%lu", sbi->s_stride);
 
 	spin_unlock(&sbi->s_lock);
 	return 0;
@@ -315,6 +351,39 @@ static struct dquot **ext21_get_dquots(struct inode *inode)
 {
 	return EXT21_I(inode)->i_dquot;
 }
+
+/*
+ * Quota charged ahead for reservation windows is settled before quota is
+ * synced, reported or turned off, so that userspace sees exact usage.
+ */
+static int ext21_quota_off(struct super_block *sb, int type)
+{
+	ext21_settle_quota_all(sb);
+	return dquot_quota_off(sb, type);
+}
+
+static int ext21_quota_sync(struct super_block *sb, int type)
+{
+	ext21_settle_quota_all(sb);
+	return dquot_quota_sync(sb, type);
+}
+
+static int ext21_get_dqblk(struct super_block *sb, struct kqid qid,
+			   struct qc_dqblk *di)
+{
+	ext21_settle_quota_all(sb);
+	return dquot_get_dqblk(sb, qid, di);
+}
+
+static const struct quotactl_ops ext21_quotactl_ops = {
+	.quota_on	= dquot_quota_on,
+	.quota_off	= ext21_quota_off,
+	.quota_sync	= ext21_quota_sync,
+	.get_state	= dquot_get_state,
+	.set_info	= dquot_set_dqinfo,
+	.get_dqblk	= ext21_get_dqblk,
+	.set_dqblk	= dquot_set_dqblk,
+};
 #endif
 
 static const struct super_operations ext21_sops = {
@@ -382,6 +451,77 @@ static const struct export_operations ext21_export_ops = {
 	.get_parent = ext21_get_parent,
 };
 
+/*
+ * Without stripe=/stride= take the geometry the block device advertises
+ * (md and most hardware RAID set these), as long as it is a whole number
+ * of blocks.
+ */
+static void ext21_setup_stripe(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	if (!sbi->s_stripe) {
+		unsigned int io_opt = bdev_io_opt(sb->s_bdev);
+
+		if (io_opt > sb->s_blocksize && !(io_opt & (sb->s_blocksize - 1)))
+			sbi->s_stripe = io_opt >> sb->s_blocksize_bits;
+	}
+	if (!sbi->s_stride) {
+		unsigned int io_min = bdev_io_min(sb->s_bdev);
+
+		if (io_min > sb->s_blocksize && !(io_min & (sb->s_blocksize - 1)))
+			sbi->s_stride = io_min >> sb->s_blocksize_bits;
+	}
+	if (sbi->s_stripe >= EXT21_BLOCKS_PER_GROUP(sb) ||
+	    sbi->s_stride >= EXT21_BLOCKS_PER_GROUP(sb)) {
+		ext21_msg(sb, KERN_WARNING,
+			"warning: stripe geometry does not fit in a block "
+			"group, ignored");
+		sbi->s_stripe = 0;
+		sbi->s_stride = 0;
+	}
+}
+
+/*
+ * Compute the overhead (FS structures) statfs subtracts from the block
+ * count.  It is constant for a given filesystem and set of mount options,
+ * so it is only recomputed at mount and remount.  Called with s_lock held.
+ */
+static void ext21_update_overhead(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+	struct ext21_super_block *es = sbi->s_es;
+	unsigned long i, overhead;
+
+	if (test_opt (sb, MINIX_DF)) {
+		WRITE_ONCE(sbi->s_overhead_last, 0);
+		return;
+	}
+
+	/*
+	 * All of the blocks before first_data_block are
+	 * overhead
+	 */
+	overhead = le32_to_cpu(es->s_first_data_block);
+
+	/*
+	 * Add the overhead attributed to the superblock and
+	 * block group descriptors.  If the sparse superblocks
+	 * feature is turned on, then not all groups have this.
+	 */
+	for (i = 0; i < sbi->s_groups_count; i++)
+		overhead += ext21_bg_has_super(sb, i) +
+			ext21_bg_num_gdb(sb, i);
+
+	/*
+	 * Every block group has an inode bitmap, a block
+	 * bitmap, and an inode table.
+	 */
+	overhead += (sbi->s_groups_count *
+		     (2 + sbi->s_itb_per_group));
+	WRITE_ONCE(sbi->s_overhead_last, overhead);
+}
+
 static unsigned long get_sb_block(void **data)
 {
 	unsigned long 	sb_block;
@@ -408,7 +548,11 @@ enum {
 	Opt_err_ro, Opt_nouid32, Opt_nocheck, Opt_debug,
 	Opt_oldalloc, Opt_orlov, Opt_nobh, Opt_user_xattr, Opt_nouser_xattr,
 	Opt_acl, Opt_noacl, Opt_xip, Opt_dax, Opt_ignore, Opt_err, Opt_quota,
-	Opt_usrquota, Opt_grpquota, Opt_reservation, Opt_noreservation
+	Opt_usrquota, Opt_grpquota, Opt_reservation, Opt_noreservation,
+	Opt_keeprsv, Opt_nokeeprsv, Opt_stripe, Opt_stride,
+	Opt_prefetch_bitmaps, Opt_noprefetch_bitmaps, Opt_smallfile,
+	Opt_reuse_truncated, Opt_noreuse_truncated, Opt_dir_prealloc,
+	Opt_defer_delete, Opt_nodefer_delete
 };
 
 static const match_table_t tokens = {
@@ -443,6 +587,18 @@ static const match_table_t tokens = {
 	{Opt_usrquota, "usrquota"},
 	{Opt_reservation, "reservation"},
 	{Opt_noreservation, "noreservation"},
+	{Opt_keeprsv, "keeprsv"},
+	{Opt_nokeeprsv, "nokeeprsv"},
+	{Opt_stripe, "stripe=%u"},
+	{Opt_stride, "stride=%u"},
+	{Opt_prefetch_bitmaps, "prefetch_bitmaps"},
+	{Opt_noprefetch_bitmaps, "noprefetch_bitmaps"},
+	{Opt_smallfile, "smallfile=%u"},
+	{Opt_reuse_truncated, "reuse_truncated"},
+	{Opt_noreuse_truncated, "noreuse_truncated"},
+	{Opt_dir_prealloc, "dir_prealloc=%u"},
+	{Opt_defer_delete, "defer_delete"},
+	{Opt_nodefer_delete, "nodefer_delete"},
 	{Opt_err, NULL}
 };
 
@@ -603,6 +759,51 @@ static int parse_options(char *options, struct super_block *sb)
 			clear_opt(sbi->s_mount_opt, RESERVATION);
 			ext21_msg(sb, KERN_INFO, "reservations OFF");
 			break;
+		case Opt_keeprsv:
+			set_opt(sbi->s_mount_opt, KEEPRSV);
+			break;
+		case Opt_nokeeprsv:
+			clear_opt(sbi->s_mount_opt, KEEPRSV);
+			break;
+		case Opt_stripe:
+			if (match_int(&args[0], &option) || option < 0)
+				return 0;
+			sbi->s_stripe = option;
+			break;
+		case Opt_stride:
+			if (match_int(&args[0], &option) || option < 0)
+				return 0;
+			sbi->s_stride = option;
+			break;
+		case Opt_prefetch_bitmaps:
+			set_opt(sbi->s_mount_opt, PREFETCH_BITMAPS);
+			break;
+		case Opt_noprefetch_bitmaps:
+			clear_opt(sbi->s_mount_opt, PREFETCH_BITMAPS);
+			break;
+		case Opt_smallfile:
+			if (match_int(&args[0], &option) || option < 0)
+				return 0;
+			sbi->s_smallfile_blocks = option;
+			break;
+		case Opt_reuse_truncated:
+			set_opt(sbi->s_mount_opt, REUSE_TRUNCATED);
+			break;
+		case Opt_noreuse_truncated:
+			clear_opt(sbi->s_mount_opt, REUSE_TRUNCATED);
+			break;
+		case Opt_dir_prealloc:
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > EXT21_MAX_RESERVE_BLOCKS)
+				return 0;
+			sbi->s_dir_prealloc = option;
+			break;
+		case Opt_defer_delete:
+			set_opt(sbi->s_mount_opt, DEFER_DELETE);
+			break;
+		case Opt_nodefer_delete:
+			clear_opt(sbi->s_mount_opt, DEFER_DELETE);
+			break;
 		case Opt_ignore:
 			break;
 		default:
@@ -809,6 +1010,7 @@ static int ext21_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed;
 	}
 	sb->s_fs_info = sbi;
+	sbi->s_sb = sb;
 	sbi->s_sb_block = sb_block;
 
 	spin_lock_init(&sbi->s_lock);
@@ -1040,6 +1242,7 @@ static int ext21_fill_super(struct super_block *sb, void *data, int silent)
 
 	if (EXT21_BLOCKS_PER_GROUP(sb) == 0)
 		goto cantfind_ext21;
+	ext21_setup_stripe(sb);
  	sbi->s_groups_count = ((le32_to_cpu(es->s_blocks_count) -
  				le32_to_cpu(es->s_first_data_block) - 1)
  					/ EXT21_BLOCKS_PER_GROUP(sb)) + 1;
@@ -1067,6 +1270,20 @@ static int ext21_fill_super(struct super_block *sb, void *data, int silent)
 			goto failed_mount_group_desc;
 		}
 	}
+	sbi->s_group_free_blocks = kcalloc(sbi->s_groups_count,
+				sizeof(*sbi->s_group_free_blocks), GFP_KERNEL);
+	if (!sbi->s_group_free_blocks) {
+		ext21_msg(sb, KERN_ERR, "error: not enough memory");
+		goto failed_mount2;
+	}
+	for (i = 0; i < sbi->s_groups_count; i++) {
+		struct ext21_group_desc *gdp = (struct ext21_group_desc *)
+			sbi->s_group_desc[i / EXT21_DESC_PER_BLOCK(sb)]->b_data +
+			i % EXT21_DESC_PER_BLOCK(sb);
+
+		sbi->s_group_free_blocks[i] =
+			le16_to_cpu(gdp->bg_free_blocks_count);
+	}
 	if (!ext21_check_descriptors (sb)) {
 		ext21_msg(sb, KERN_ERR, "group descriptors corrupted");
 		goto failed_mount2;
@@ -1090,6 +1307,10 @@ static int ext21_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->s_rsv_window_head.rsv_goal_size = 0;
 	ext21_rsv_window_add(sb, &sbi->s_rsv_window_head);
 
+	spin_lock(&sbi->s_lock);
+	ext21_update_overhead(sb);
+	spin_unlock(&sbi->s_lock);
+
 	err = percpu_counter_init(&sbi->s_freeblocks_counter,
 				ext21_count_free_blocks(sb), GFP_KERNEL);
 	if (!err) {
@@ -1104,6 +1325,21 @@ static int ext21_fill_super(struct super_block *sb, void *data, int silent)
 		ext21_msg(sb, KERN_ERR, "error: insufficient memory");
 		goto failed_mount3;
 	}
+	INIT_WORK(&sbi->s_bitmap_warm_work, ext21_warm_block_bitmaps);
+	mutex_init(&sbi->s_orphan_lock);
+	INIT_LIST_HEAD(&sbi->s_orphan_list);
+	INIT_DELAYED_WORK(&sbi->s_orphan_work, ext21_orphan_work);
+	err = ext21_register_retained_shrinker(sb);
+	if (err) {
+		ext21_msg(sb, KERN_ERR, "error: insufficient memory");
+		goto failed_mount3;
+	}
+	err = ext21_register_map_shrinker(sb);
+	if (err) {
+		unregister_shrinker(&sbi->s_retained_shrinker);
+		ext21_msg(sb, KERN_ERR, "error: insufficient memory");
+		goto failed_mount3;
+	}
 	/*
 	 * set up enough so that it can read an inode
 	 */
@@ -1113,33 +1349,37 @@ static int ext21_fill_super(struct super_block *sb, void *data, int silent)
 
 #ifdef CONFIG_QUOTA
 	sb->dq_op = &dquot_operations;
-	sb->s_qcop = &dquot_quotactl_ops;
+	sb->s_qcop = &ext21_quotactl_ops;
 	sb->s_quota_types = QTYPE_MASK_USR | QTYPE_MASK_GRP;
 #endif
 
 	root = ext21_iget(sb, EXT21_ROOT_INO);
 	if (IS_ERR(root)) {
 		ret = PTR_ERR(root);
-		goto failed_mount3;
+		goto failed_mount4;
 	}
 	if (!S_ISDIR(root->i_mode) || !root->i_blocks || !root->i_size) {
 		iput(root);
 		ext21_msg(sb, KERN_ERR, "error: corrupt root inode, run e2fsck");
-		goto failed_mount3;
+		goto failed_mount4;
 	}
 
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		ext21_msg(sb, KERN_ERR, "error: get root inode failed");
 		ret = -ENOMEM;
-		goto failed_mount3;
+		goto failed_mount4;
 	}
 	if (EXT21_HAS_COMPAT_FEATURE(sb, EXT3_FEATURE_COMPAT_HAS_JOURNAL))
 		ext21_msg(sb, KERN_WARNING,
 			"warning: mounting ext3 filesystem as ext21");
 	if (ext21_setup_super (sb, es, sb->s_flags & MS_RDONLY))
 		sb->s_flags |= MS_RDONLY;
+	if (!(sb->s_flags & MS_RDONLY))
+		ext21_orphan_cleanup(sb);
 	ext21_write_super(sb);
+	if (test_opt(sb, PREFETCH_BITMAPS) && !(sb->s_flags & MS_RDONLY))
+		queue_work(system_unbound_wq, &sbi->s_bitmap_warm_work);
 	return 0;
 
 cantfind_ext21:
@@ -1148,11 +1388,15 @@ cantfind_ext21:
 			"error: can't find an ext21 filesystem on dev %s.",
 			sb->s_id);
 	goto failed_mount;
+failed_mount4:
+	unregister_shrinker(&sbi->s_map_shrinker);
+	unregister_shrinker(&sbi->s_retained_shrinker);
 failed_mount3:
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
 failed_mount2:
+	kfree(sbi->s_group_free_blocks);
 	for (i = 0; i < db_count; i++)
 		brelse(sbi->s_group_desc[i]);
 failed_mount_group_desc:
@@ -1192,6 +1436,7 @@ static void ext21_sync_super(struct super_block *sb, struct ext21_super_block *e
 			    int wait)
 {
 	ext21_clear_super_error(sb);
+	ext21_fold_group_counters(sb);
 	spin_lock(&EXT21_SB(sb)->s_lock);
 	es->s_free_blocks_count = cpu_to_le32(ext21_count_free_blocks(sb));
 	es->s_free_inodes_count = cpu_to_le32(ext21_count_free_inodes(sb));
@@ -1218,10 +1463,21 @@ static int ext21_sync_fs(struct super_block *sb, int wait)
 	struct ext21_sb_info *sbi = EXT21_SB(sb);
 	struct ext21_super_block *es = EXT21_SB(sb)->s_es;
 
+	/*
+	 * Freezing, with writes and page faults stopped: blocks held for
+	 * rewrites must not stay allocated in the image.  Released here
+	 * rather than in ext21_freeze(), where the last iput() of a deleted
+	 * inode would wait for the freeze forever; sync_blockdev() writes
+	 * the bitmaps out after us.
+	 */
+	if (wait && sb->s_writers.frozen == SB_FREEZE_PAGEFAULT)
+		ext21_release_retained(sb);
+
 	/*
 	 * Write quota structures to quota file, sync_blockdev() will write
 	 * them to disk later
 	 */
+	ext21_settle_quota_all(sb);
 	dquot_writeback_dquots(sb, -1);
 
 	spin_lock(&sbi->s_lock);
@@ -1278,6 +1534,13 @@ static int ext21_remount (struct super_block * sb, int * flags, char * data)
 	unsigned long old_sb_flags;
 	int err;
 
+	if ((*flags & MS_RDONLY) && !(sb->s_flags & MS_RDONLY)) {
+		ext21_orphan_stop(sb);
+		/* nothing may free blocks behind the valid superblock */
+		cancel_work_sync(&sbi->s_release_work);
+		cancel_delayed_work_sync(&sbi->s_recycle_work);
+		ext21_release_retained(sb);
+	}
 	sync_filesystem(sb);
 	spin_lock(&sbi->s_lock);
 
@@ -1286,6 +1549,10 @@ static int ext21_remount (struct super_block * sb, int * flags, char * data)
 	old_opts.s_mount_opt = sbi->s_mount_opt;
 	old_opts.s_resuid = sbi->s_resuid;
 	old_opts.s_resgid = sbi->s_resgid;
+	old_opts.s_stripe = sbi->s_stripe;
+	old_opts.s_stride = sbi->s_stride;
+	old_opts.s_smallfile_blocks = sbi->s_smallfile_blocks;
+	old_opts.s_dir_prealloc = sbi->s_dir_prealloc;
 
 	/*
 	 * Allow the "check" option to be passed as a remount option.
@@ -1294,6 +1561,11 @@ static int ext21_remount (struct super_block * sb, int * flags, char * data)
 		err = -EINVAL;
 		goto restore_opts;
 	}
+	ext21_setup_stripe(sb);
+	ext21_update_overhead(sb);
+	if (test_opt(sb, PREFETCH_BITMAPS) && !(*flags & MS_RDONLY) &&
+	    !(old_opts.s_mount_opt & EXT21_MOUNT_PREFETCH_BITMAPS))
+		queue_work(system_unbound_wq, &sbi->s_bitmap_warm_work);
 
 	sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
 		((sbi->s_mount_opt & EXT21_MOUNT_POSIX_ACL) ? MS_POSIXACL : 0);
@@ -1351,6 +1623,8 @@ static int ext21_remount (struct super_block * sb, int * flags, char * data)
 			sb->s_flags &= ~MS_RDONLY;
 		spin_unlock(&sbi->s_lock);
 
+		if (!(sb->s_flags & MS_RDONLY))
+			ext21_orphan_cleanup(sb);
 		ext21_write_super(sb);
 
 		dquot_resume(sb, -1);
@@ -1361,8 +1635,16 @@ restore_opts:
 	sbi->s_mount_opt = old_opts.s_mount_opt;
 	sbi->s_resuid = old_opts.s_resuid;
 	sbi->s_resgid = old_opts.s_resgid;
+	sbi->s_stripe = old_opts.s_stripe;
+	sbi->s_stride = old_opts.s_stride;
+	sbi->s_smallfile_blocks = old_opts.s_smallfile_blocks;
+	sbi->s_dir_prealloc = old_opts.s_dir_prealloc;
+	ext21_update_overhead(sb);
 	sb->s_flags = old_sb_flags;
 	spin_unlock(&sbi->s_lock);
+	/* still read-write: the orphans go on being freed */
+	if (!(sb->s_flags & MS_RDONLY))
+		ext21_orphan_cleanup(sb);
 	return err;
 }
 
@@ -1373,63 +1655,26 @@ static int ext21_statfs (struct dentry * dentry, struct kstatfs * buf)
 	struct ext21_super_block *es = sbi->s_es;
 	u64 fsid;
 
-	spin_lock(&sbi->s_lock);
-
-	if (test_opt (sb, MINIX_DF))
-		sbi->s_overhead_last = 0;
-	else if (sbi->s_blocks_last != le32_to_cpu(es->s_blocks_count)) {
-		unsigned long i, overhead = 0;
-		smp_rmb();
-
-		/*
-		 * Compute the overhead (FS structures). This is constant
-		 * for a given filesystem unless the number of block groups
-		 * changes so we cache the previous value until it does.
-		 */
-
-		/*
-		 * All of the blocks before first_data_block are
-		 * overhead
-		 */
-		overhead = le32_to_cpu(es->s_first_data_block);
-
-		/*
-		 * Add the overhead attributed to the superblock and
-		 * block group descriptors.  If the sparse superblocks
-		 * feature is turned on, then not all groups have this.
-		 */
-		for (i = 0; i < sbi->s_groups_count; i++)
-			overhead += ext21_bg_has_super(sb, i) +
-				ext21_bg_num_gdb(sb, i);
-
-		/*
-		 * Every block group has an inode bitmap, a block
-		 * bitmap, and an inode table.
-		 */
-		overhead += (sbi->s_groups_count *
-			     (2 + sbi->s_itb_per_group));
-		sbi->s_overhead_last = overhead;
-		smp_wmb();
-		sbi->s_blocks_last = le32_to_cpu(es->s_blocks_count);
-	}
-
+	/*
+	 * No s_lock and no walk over the group descriptors: the free counts
+	 * come from the percpu counters, the overhead is computed at mount
+	 * and remount, and the superblock copies are left to sync time.
+	 */
 	buf->f_type = EXT21_SUPER_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
-	buf->f_blocks = le32_to_cpu(es->s_blocks_count) - sbi->s_overhead_last;
-	buf->f_bfree = ext21_count_free_blocks(sb);
-	es->s_free_blocks_count = cpu_to_le32(buf->f_bfree);
+	buf->f_blocks = le32_to_cpu(es->s_blocks_count) -
+			READ_ONCE(sbi->s_overhead_last);
+	buf->f_bfree = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
 	buf->f_bavail = buf->f_bfree - le32_to_cpu(es->s_r_blocks_count);
 	if (buf->f_bfree < le32_to_cpu(es->s_r_blocks_count))
 		buf->f_bavail = 0;
 	buf->f_files = le32_to_cpu(es->s_inodes_count);
-	buf->f_ffree = ext21_count_free_inodes(sb);
-	es->s_free_inodes_count = cpu_to_le32(buf->f_ffree);
+	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
 	buf->f_namelen = EXT21_NAME_LEN;
 	fsid = le64_to_cpup((void *)es->s_uuid) ^
 	       le64_to_cpup((void *)es->s_uuid + sizeof(u64));
 	buf->f_fsid.val[0] = fsid & 0xFFFFFFFFUL;
 	buf->f_fsid.val[1] = (fsid >> 32) & 0xFFFFFFFFUL;
-	spin_unlock(&sbi->s_lock);
 	return 0;
 }
 
@@ -1544,11 +1789,30 @@ out:
 
 #endif
 
+/*
+ * Stop everything that may grab inodes or touch the bitmaps in the
+ * background before generic_shutdown_super() evicts the inodes.
+ */
+static void ext21_kill_sb(struct super_block *sb)
+{
+	struct ext21_sb_info *sbi = EXT21_SB(sb);
+
+	if (sbi) {
+		clear_opt(sbi->s_mount_opt, PREFETCH_BITMAPS);
+		cancel_work_sync(&sbi->s_bitmap_warm_work);
+		unregister_shrinker(&sbi->s_retained_shrinker);
+		unregister_shrinker(&sbi->s_map_shrinker);
+		cancel_delayed_work_sync(&sbi->s_recycle_work);
+		cancel_work_sync(&sbi->s_release_work);
+	}
+	kill_block_super(sb);
+}
+
 static struct file_system_type ext21_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ext21",
 	.mount		= ext21_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= ext21_kill_sb,
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 MODULE_ALIAS_FS("ext21");
@@ -1562,11 +1826,16 @@ static int __init init_ext21_fs(void)
 	err = init_inodecache();
 	if (err)
 		goto out1;
+	err = ext21_init_map_cache();
+	if (err)
+		goto out2;
         err = register_filesystem(&ext21_fs_type);
 	if (err)
 		goto out;
 	return 0;
 out:
+	ext21_destroy_map_cache();
+out2:
 	destroy_inodecache();
 out1:
 	exit_ext21_xattr();
@@ -1576,6 +1845,7 @@ out1:
 static void __exit exit_ext21_fs(void)
 {
 	unregister_filesystem(&ext21_fs_type);
+	ext21_destroy_map_cache();
 	destroy_inodecache();
 	exit_ext21_xattr();
 }
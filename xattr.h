@@ -22,6 +22,12 @@
 #define EXT21_XATTR_INDEX_TRUSTED		4
 #define	EXT21_XATTR_INDEX_LUSTRE			5
 #define EXT21_XATTR_INDEX_SECURITY	        6
+#define EXT21_XATTR_INDEX_SYSTEM		7	/* no handler, ours only */
+
+/* system.placement: the placement hint, see ext21_save_placement() */
+#define EXT21_XATTR_PLACEMENT		"placement"
+/* system.alloc_flags: EXT21_ALLOC_*, see ext21_save_alloc_flags() */
+#define EXT21_XATTR_ALLOC_FLAGS		"alloc_flags"
 
 struct ext21_xattr_header {
 	__le32	h_magic;	/* magic number for identification */